@@ -0,0 +1,54 @@
+#pragma once
+// Host stand-in for the STM32duino core, only built for env:native.
+// Time is virtual and only moves through delay()/NativeHal::advanceMicros().
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <functional>
+#include <optional>
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define INPUT_PULLDOWN 0x3
+
+#define RISING 0x1
+#define FALLING 0x2
+#define CHANGE 0x3
+
+enum
+{
+    PA0, PA1, PA2, PA3, PA4, PA5, PA6, PA7, PA8, PA9, PA10, PA11, PA12, PA13, PA14, PA15,
+    PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7, PB8, PB9, PB10, PB11, PB12, PB13, PB14, PB15,
+    PC13, PC14, PC15,
+    NUM_DIGITAL_PINS
+};
+
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+void digitalToggle(uint32_t pin);
+
+void noInterrupts();
+void interrupts();
+void __WFI(); // returns at once, nothing on the host waits for an interrupt
+
+#define digitalPinToInterrupt(p) (p)
+void attachInterrupt(uint32_t pin, std::function<void(void)> callback, uint32_t mode);
+void detachInterrupt(uint32_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(uint32_t us);
+
+#include "HardwareSerial.h"
+#include "HardwareTimer.h"
+#include "HalFlash.h"
+#include "CoreDebug.h"
@@ -0,0 +1,23 @@
+#pragma once
+// Cortex-M3 debug registers used for cycle counting. CYCCNT runs at SystemCoreClock
+// along with the virtual clock (NativeHal::advanceMicros) once it is enabled.
+#include <cstdint>
+
+struct DWT_Type
+{
+    volatile uint32_t CTRL;
+    volatile uint32_t CYCCNT;
+};
+struct CoreDebug_Type
+{
+    volatile uint32_t DEMCR;
+};
+extern DWT_Type nativeDwt;
+extern CoreDebug_Type nativeCoreDebug;
+#define DWT (&nativeDwt)
+#define CoreDebug (&nativeCoreDebug)
+
+#define DWT_CTRL_CYCCNTENA_Msk 0x00000001U
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000U
+
+extern uint32_t SystemCoreClock; // 72 MHz, like the Bluepill
@@ -0,0 +1,36 @@
+#pragma once
+// Host stand-in for the STM32F1 HAL flash driver: 64 KB of 1 KB pages held in RAM.
+// Addresses are host pointers into that array, so FLASH_BASE is not 0x08000000 here.
+#include <cstdint>
+#include <cstddef>
+
+#define FLASH_PAGE_SIZE 0x400U
+#define NATIVE_FLASH_SIZE 0x10000U
+extern uint8_t nativeFlash[NATIVE_FLASH_SIZE];
+#define FLASH_BASE (reinterpret_cast<uintptr_t>(nativeFlash))
+
+typedef enum
+{
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+#define FLASH_TYPEERASE_PAGES 0x00U
+#define FLASH_TYPEPROGRAM_HALFWORD 0x01U
+#define FLASH_TYPEPROGRAM_WORD 0x02U
+#define FLASH_BANK_1 1U
+
+typedef struct
+{
+    uint32_t TypeErase;
+    uint32_t Banks;
+    uintptr_t PageAddress;
+    uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock();
+HAL_StatusTypeDef HAL_FLASH_Lock();
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* init, uint32_t* pageError);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t typeProgram, uintptr_t address, uint64_t data); // fails on unerased cells, like the real one
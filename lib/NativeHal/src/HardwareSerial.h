@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#ifndef SERIAL_TX_BUFFER_SIZE
+#define SERIAL_TX_BUFFER_SIZE 1024
+#endif
+
+// USART register block, only the fields the firmware touches directly
+struct USART_TypeDef
+{
+    volatile uint32_t SR;
+    volatile uint32_t DR;
+    volatile uint32_t BRR;
+    volatile uint32_t CR1;
+    volatile uint32_t CR2;
+    volatile uint32_t CR3;
+    volatile uint32_t GTPR;
+};
+extern USART_TypeDef nativeUsart1;
+#define USART1 (&nativeUsart1)
+
+#define USART_SR_PE   0x001
+#define USART_SR_FE   0x002
+#define USART_SR_NE   0x004
+#define USART_SR_ORE  0x008
+#define USART_SR_IDLE 0x010
+#define USART_SR_RXNE 0x020
+#define USART_SR_TC   0x040
+#define USART_SR_TXE  0x080
+#define USART_CR3_HDSEL 0x008
+
+// Each peripheral pointer maps to one virtual port in NativeHal, so copies of a
+// HardwareSerial (as FusionBusSlave makes) share the same buffers.
+class HardwareSerial
+{
+public:
+    HardwareSerial(void* peripheral);
+
+    void begin(unsigned long baud);
+    void end();
+    int available();
+    int peek();
+    int read();
+    int availableForWrite();
+    void flush();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    size_t print(const char* str);
+    size_t print(unsigned long value);
+    size_t println(const char* str = "");
+    size_t println(unsigned long value);
+
+private:
+    void* peripheral_;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+// TIM register block, only the fields the firmware touches directly
+struct TIM_TypeDef
+{
+    volatile uint32_t CR1;
+    volatile uint32_t CCMR1;
+    volatile uint32_t CNT;
+    volatile uint32_t PSC;
+    volatile uint32_t ARR;
+    volatile uint32_t CCR1;
+};
+extern TIM_TypeDef nativeTim3;
+#define TIM3 (&nativeTim3)
+
+#define TIM_CR1_ARPE 0x080
+#define TIM_CCMR1_OC1PE 0x008
+
+enum TimerFormat_t
+{
+    TICK_FORMAT,
+    MICROSEC_FORMAT,
+    HERTZ_FORMAT
+};
+
+enum TimerCompareFormat_t
+{
+    TICK_COMPARE_FORMAT,
+    MICROSEC_COMPARE_FORMAT,
+    HERTZ_COMPARE_FORMAT,
+    PERCENT_COMPARE_FORMAT,
+    RESOLUTION_8B_COMPARE_FORMAT,
+    RESOLUTION_16B_COMPARE_FORMAT
+};
+
+enum TimerModes_t
+{
+    TIMER_DISABLED,
+    TIMER_OUTPUT_COMPARE,
+    TIMER_OUTPUT_COMPARE_ACTIVE,
+    TIMER_OUTPUT_COMPARE_INACTIVE,
+    TIMER_OUTPUT_COMPARE_TOGGLE,
+    TIMER_OUTPUT_COMPARE_PWM1,
+    TIMER_OUTPUT_COMPARE_PWM2
+};
+
+// Timers never fire on their own: NativeHal::tickTimers() runs the callback of
+// every resumed timer once, standing in for one update interrupt, while
+// NativeHal::runFor() fires each one whenever its programmed period runs out.
+class HardwareTimer
+{
+public:
+    HardwareTimer(TIM_TypeDef* instance);
+    ~HardwareTimer();
+    HardwareTimer(const HardwareTimer&) = delete;
+    HardwareTimer& operator=(const HardwareTimer&) = delete;
+
+    void setOverflow(uint32_t value, TimerFormat_t format = TICK_FORMAT);
+    uint32_t getOverflow(TimerFormat_t format = TICK_FORMAT) const;
+    void setPrescaleFactor(uint32_t prescaler);
+    void setCount(uint32_t value, TimerFormat_t format = TICK_FORMAT);
+    void refresh();
+    void setMode(uint32_t channel, TimerModes_t mode, uint32_t pin = 0);
+    void setCaptureCompare(uint32_t channel, uint32_t compare, TimerCompareFormat_t format = TICK_COMPARE_FORMAT);
+    void attachInterrupt(std::function<void(void)> callback);
+    void detachInterrupt();
+    void resume();
+    void pause();
+    bool isRunning() const { return running_; }
+    uint32_t getTimerClkFreq() const { return 72000000; }
+
+    void fire(); // invoke the update callback, used by NativeHal
+    unsigned long untilUpdateUs() const; // virtual time left in the running period
+    void elapse(unsigned long us); // count virtual time, fire at the end of the period
+
+private:
+    TIM_TypeDef* instance_;
+    std::function<void(void)> callback_;
+    uint32_t overflow_ = 0;
+    bool running_ = false;
+    unsigned long countUs_ = 0; // virtual time into the running period
+    unsigned long periodUs() const;
+    bool blocked() const;
+};
@@ -0,0 +1,340 @@
+#include "NativeHal.h"
+#include <deque>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+USART_TypeDef nativeUsart1 = {USART_SR_TC | USART_SR_TXE, 0, 0, 0, 0, 0, 0};
+TIM_TypeDef nativeTim3 = {};
+DWT_Type nativeDwt = {};
+CoreDebug_Type nativeCoreDebug = {};
+uint32_t SystemCoreClock = 72000000;
+uint8_t nativeFlash[NATIVE_FLASH_SIZE];
+HardwareSerial Serial(nullptr); // console, kept apart from USART1
+
+namespace
+{
+    struct SerialPort
+    {
+        std::deque<uint8_t> rx;
+        std::string tx;
+        unsigned long baud = 0;
+    };
+
+    unsigned long nowUs = 0;
+    int pins[NUM_DIGITAL_PINS] = {};
+    std::map<void*, SerialPort> ports;
+    std::vector<HardwareTimer*> timers;
+    struct PinInterrupt
+    {
+        std::function<void(void)> callback;
+        uint32_t mode = 0;
+    };
+    std::map<uint32_t, PinInterrupt> pinInterrupts;
+    std::map<uint32_t, std::function<void(int)>> pinWriteHooks;
+    bool flashUnlocked = false;
+    unsigned long flashErases = 0;
+    [[maybe_unused]] const bool flashBlank = (std::fill(std::begin(nativeFlash), std::end(nativeFlash), 0xFF), true);
+
+    bool inFlash(uintptr_t address, size_t size)
+    {
+        return address >= FLASH_BASE and address + size <= FLASH_BASE + NATIVE_FLASH_SIZE;
+    }
+
+    SerialPort& port(void* peripheral)
+    {
+        return ports[peripheral];
+    }
+}
+
+void pinMode(uint32_t pin, uint32_t mode)
+{
+    if(pin >= NUM_DIGITAL_PINS) return;
+    if(mode == INPUT_PULLUP) pins[pin] = HIGH;
+    if(mode == INPUT_PULLDOWN) pins[pin] = LOW;
+}
+
+void digitalWrite(uint32_t pin, uint32_t value)
+{
+    if(pin >= NUM_DIGITAL_PINS) return;
+    const int level = value ? HIGH : LOW;
+    if(pins[pin] == level) return;
+    pins[pin] = level;
+    auto hook = pinWriteHooks.find(pin);
+    if(hook != pinWriteHooks.end()) hook->second(level);
+}
+
+int digitalRead(uint32_t pin)
+{
+    return pin < NUM_DIGITAL_PINS ? pins[pin] : LOW;
+}
+
+void digitalToggle(uint32_t pin)
+{
+    if(pin < NUM_DIGITAL_PINS) pins[pin] = !pins[pin];
+}
+
+void noInterrupts() {}
+void interrupts() {}
+void __WFI() {}
+
+void attachInterrupt(uint32_t pin, std::function<void(void)> callback, uint32_t mode)
+{
+    pinInterrupts[pin] = PinInterrupt{std::move(callback), mode};
+}
+
+void detachInterrupt(uint32_t pin)
+{
+    pinInterrupts.erase(pin);
+}
+
+unsigned long millis() { return nowUs / 1000; }
+unsigned long micros() { return nowUs; }
+void delay(unsigned long ms) { nowUs += ms * 1000; }
+void delayMicroseconds(uint32_t us) { nowUs += us; }
+
+HardwareSerial::HardwareSerial(void* peripheral): peripheral_(peripheral) {}
+
+void HardwareSerial::begin(unsigned long baud) { port(peripheral_).baud = baud; }
+void HardwareSerial::end() { port(peripheral_).baud = 0; }
+int HardwareSerial::available() { return (int)port(peripheral_).rx.size(); }
+
+int HardwareSerial::peek()
+{
+    auto& rx = port(peripheral_).rx;
+    return rx.empty() ? -1 : rx.front();
+}
+
+int HardwareSerial::read()
+{
+    auto& rx = port(peripheral_).rx;
+    if(rx.empty()) return -1;
+    const int c = rx.front();
+    rx.pop_front();
+    return c;
+}
+
+int HardwareSerial::availableForWrite() { return SERIAL_TX_BUFFER_SIZE - 1; } // written data leaves at once
+void HardwareSerial::flush() {}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+// In half-duplex mode (HDSEL) the receiver shares the line and hears every byte sent
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size)
+{
+    SerialPort& serial = port(peripheral_);
+    serial.tx.append((const char*)buffer, size);
+    if(peripheral_ == USART1 and (USART1->CR3 & USART_CR3_HDSEL))
+        serial.rx.insert(serial.rx.end(), buffer, buffer + size);
+    return size;
+}
+
+size_t HardwareSerial::print(const char* str)
+{
+    return write((const uint8_t*)str, std::strlen(str));
+}
+
+size_t HardwareSerial::println(const char* str)
+{
+    return print(str) + print("\r\n");
+}
+
+size_t HardwareSerial::print(unsigned long value)
+{
+    return print(std::to_string(value).c_str());
+}
+
+size_t HardwareSerial::println(unsigned long value)
+{
+    return print(value) + print("\r\n");
+}
+
+HardwareTimer::HardwareTimer(TIM_TypeDef* instance): instance_(instance)
+{
+    timers.push_back(this);
+}
+
+HardwareTimer::~HardwareTimer()
+{
+    timers.erase(std::remove(timers.begin(), timers.end(), this), timers.end());
+}
+
+void HardwareTimer::setOverflow(uint32_t value, TimerFormat_t format)
+{
+    (void)format; // ticks and microseconds are treated alike (1 MHz counter)
+    overflow_ = value;
+    instance_->ARR = value - 1;
+}
+
+uint32_t HardwareTimer::getOverflow(TimerFormat_t) const { return overflow_; }
+void HardwareTimer::setPrescaleFactor(uint32_t prescaler) { instance_->PSC = prescaler - 1; }
+void HardwareTimer::setCount(uint32_t value, TimerFormat_t)
+{
+    instance_->CNT = value;
+    countUs_ = value * (instance_->PSC + 1) / (getTimerClkFreq() / 1000000);
+}
+void HardwareTimer::refresh() {}
+void HardwareTimer::setMode(uint32_t, TimerModes_t, uint32_t) {}
+void HardwareTimer::setCaptureCompare(uint32_t, uint32_t compare, TimerCompareFormat_t) { instance_->CCR1 = compare; }
+void HardwareTimer::attachInterrupt(std::function<void(void)> callback) { callback_ = std::move(callback); }
+void HardwareTimer::detachInterrupt() { callback_ = nullptr; }
+void HardwareTimer::resume() { running_ = true; }
+void HardwareTimer::pause() { running_ = false; }
+
+void HardwareTimer::fire()
+{
+    if(running_ and callback_) callback_();
+}
+
+// PSC and ARR as the firmware left them, it may reprogram both from the update callback
+unsigned long HardwareTimer::periodUs() const
+{
+    return std::max<unsigned long>(1, (unsigned long)(instance_->PSC + 1) * (instance_->ARR + 1) / (getTimerClkFreq() / 1000000));
+}
+
+// ARR 0 blocks the counter (RM0008): no update ever comes
+bool HardwareTimer::blocked() const
+{
+    return instance_->ARR == 0;
+}
+
+unsigned long HardwareTimer::untilUpdateUs() const
+{
+    if(blocked())
+        return ULONG_MAX;
+    return countUs_ < periodUs() ? periodUs() - countUs_ : 0;
+}
+
+void HardwareTimer::elapse(unsigned long us)
+{
+    if(!running_ or blocked())
+        return;
+    countUs_ += us;
+    instance_->CNT = countUs_ * (getTimerClkFreq() / 1000000) / (instance_->PSC + 1);
+    if(countUs_ < periodUs())
+        return;
+    countUs_ = 0;
+    instance_->CNT = 0;
+    fire();
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock() { flashUnlocked = true; return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_Lock() { flashUnlocked = false; return HAL_OK; }
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef* init, uint32_t* pageError)
+{
+    *pageError = 0xFFFFFFFF;
+    const size_t size = (size_t)init->NbPages * FLASH_PAGE_SIZE;
+    if(!flashUnlocked or init->TypeErase != FLASH_TYPEERASE_PAGES or 
+       (init->PageAddress - FLASH_BASE) % FLASH_PAGE_SIZE != 0 or !inFlash(init->PageAddress, size))
+        return HAL_ERROR;
+    std::memset(reinterpret_cast<void*>(init->PageAddress), 0xFF, size);
+    flashErases += init->NbPages;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t typeProgram, uintptr_t address, uint64_t data)
+{
+    const size_t size = typeProgram == FLASH_TYPEPROGRAM_HALFWORD ? 2 : typeProgram == FLASH_TYPEPROGRAM_WORD ? 4 : 8;
+    if(!flashUnlocked or address % 2 != 0 or !inFlash(address, size))
+        return HAL_ERROR;
+    uint8_t* cell = reinterpret_cast<uint8_t*>(address);
+    for(size_t i = 0; i < size; i++)
+        if(cell[i] != 0xFF) return HAL_ERROR; // F1 flash only programs erased halfwords
+    std::memcpy(cell, &data, size); // little-endian, like the target
+    return HAL_OK;
+}
+
+namespace NativeHal
+{
+    void reset()
+    {
+        nowUs = 0;
+        std::fill(std::begin(pins), std::end(pins), LOW);
+        ports.clear();
+        pinInterrupts.clear();
+        pinWriteHooks.clear();
+        nativeUsart1 = {};
+        nativeUsart1.SR = USART_SR_TC | USART_SR_TXE; // transmitter idle, writes complete instantly
+        nativeTim3 = {};
+        nativeDwt = {};
+        nativeCoreDebug = {};
+    }
+
+    void eraseFlash()
+    {
+        std::fill(std::begin(nativeFlash), std::end(nativeFlash), 0xFF);
+        flashErases = 0;
+    }
+
+    unsigned long flashEraseCount() { return flashErases; }
+
+    void advanceMicros(unsigned long us) 
+    { 
+        nowUs += us; 
+        if((nativeCoreDebug.DEMCR & CoreDebug_DEMCR_TRCENA_Msk) and (nativeDwt.CTRL & DWT_CTRL_CYCCNTENA_Msk))
+            nativeDwt.CYCCNT += us * (SystemCoreClock / 1000000);
+    }
+
+    void tickTimers()
+    {
+        for(auto* timer : timers)
+            timer->fire();
+    }
+
+    void runFor(unsigned long us)
+    {
+        while(us > 0)
+        {
+            unsigned long step = us;
+            for(auto* timer : timers)
+                if(timer->isRunning()) step = std::min(step, std::max(1UL, timer->untilUpdateUs()));
+            advanceMicros(step);
+            us -= step;
+            for(auto* timer : timers)
+                timer->elapse(step);
+        }
+    }
+
+    void setPin(uint32_t pin, int level)
+    {
+        const int previous = digitalRead(pin);
+        digitalWrite(pin, level);
+        auto it = pinInterrupts.find(pin);
+        if(it == pinInterrupts.end() or previous == digitalRead(pin)) 
+            return;
+        const uint32_t edge = digitalRead(pin) ? RISING : FALLING;
+        if(it->second.mode == CHANGE or it->second.mode == edge)
+            it->second.callback();
+    }
+    int pin(uint32_t pin) { return digitalRead(pin); }
+
+    void onPinWrite(uint32_t pin, std::function<void(int level)> callback)
+    {
+        pinWriteHooks[pin] = std::move(callback);
+    }
+
+    void serialInject(void* peripheral, const uint8_t* data, size_t size)
+    {
+        auto& rx = port(peripheral).rx;
+        rx.insert(rx.end(), data, data + size);
+    }
+
+    void serialInject(void* peripheral, const std::string& data)
+    {
+        serialInject(peripheral, (const uint8_t*)data.data(), data.size());
+    }
+
+    std::string serialTakeOutput(void* peripheral)
+    {
+        std::string out;
+        out.swap(port(peripheral).tx);
+        return out;
+    }
+
+    unsigned long serialBaud(void* peripheral) { return port(peripheral).baud; }
+}
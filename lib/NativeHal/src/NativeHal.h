@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+#include <functional>
+#include <string>
+
+// Control surface of the host stand-ins: drive virtual time, pins, timers and
+// serial ports from benchmarks and simulators.
+namespace NativeHal
+{
+    void reset(); // clears pins, serial buffers and rewinds the virtual clock, flash survives like a power cycle
+    void eraseFlash(); // factory-fresh flash (all 0xFF)
+    unsigned long flashEraseCount();
+
+    void advanceMicros(unsigned long us);
+    void tickTimers(); // one update interrupt on every resumed timer
+    void runFor(unsigned long us); // advances the clock, timers fire as their PSC/ARR period ends
+
+    void setPin(uint32_t pin, int level);
+    int pin(uint32_t pin);
+    void onPinWrite(uint32_t pin, std::function<void(int level)> callback); // level changes by the firmware
+
+    void serialInject(void* peripheral, const uint8_t* data, size_t size);
+    void serialInject(void* peripheral, const std::string& data);
+    std::string serialTakeOutput(void* peripheral);
+    unsigned long serialBaud(void* peripheral);
+}
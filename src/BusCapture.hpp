@@ -0,0 +1,122 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Timestamped FusionBus receive capture, compact enough to keep a few seconds of traffic
+// in RAM on the device and to replay it on the host (test/test_replay).
+// Format, a sequence of records:
+//   delta  base-128 varint, least significant group first: ms since the previous record
+//          (the first record: since the capture started)
+//   count  one byte, 1..255: bytes received within that millisecond
+//   bytes  the received bytes
+// A millisecond with more than 255 bytes continues in a record with delta 0.
+namespace BusCapture
+{
+    struct Record
+    {
+        unsigned long atMs; // since the capture started
+        const uint8_t* bytes;
+        size_t size;
+    };
+
+    // Walks a capture; a record cut off at the end (a full recorder) is not returned
+    class Reader
+    {
+    public:
+        Reader(const uint8_t* data, size_t size): data_(data), size_(size) {}
+
+        bool next(Record& record)
+        {
+            unsigned long delta = 0;
+            size_t at = offset_;
+            for(unsigned shift = 0;; shift += 7)
+            {
+                if(at >= size_ or shift > 28) return false;
+                const uint8_t group = data_[at++];
+                delta |= (unsigned long)(group & 0x7F) << shift;
+                if(!(group & 0x80)) break;
+            }
+            if(at >= size_ or data_[at] == 0 or size_ - at - 1 < data_[at]) return false;
+            const size_t count = data_[at++];
+            atMs_ += delta;
+            record = {atMs_, data_ + at, count};
+            offset_ = at + count;
+            return true;
+        }
+
+        bool done() const { return offset_ == size_; } // false after next() failed on a torn record
+
+    private:
+        const uint8_t* data_;
+        size_t size_;
+        size_t offset_ = 0;
+        unsigned long atMs_ = 0;
+    };
+
+    // Records received bytes until Capacity is used up, then keeps the start and drops
+    // the rest: a few comparisons and stores per byte, cheap enough for the receive path
+    template<size_t Capacity>
+    class Recorder
+    {
+    public:
+        static_assert(Capacity >= 8, "Capture too small for a record");
+
+        void record(uint8_t byte, unsigned long nowMs)
+        {
+            if(frozen_)
+                return;
+            if(size_ == 0)
+                lastMs_ = nowMs;
+            if(countAt_ == kNoRecord or nowMs != lastMs_ or data_[countAt_] == 255)
+            {
+                uint8_t header[5];
+                size_t length = 0;
+                for(uint32_t delta = (uint32_t)(nowMs - lastMs_);; delta >>= 7) // 5 groups at most
+                {
+                    header[length++] = (uint8_t)((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0));
+                    if(delta <= 0x7F) break;
+                }
+                if(Capacity - size_ < length + 2)
+                {
+                    dropped_++;
+                    return;
+                }
+                for(size_t i = 0; i < length; i++)
+                    data_[size_++] = header[i];
+                countAt_ = size_;
+                data_[size_++] = 0;
+                lastMs_ = nowMs;
+            }
+            else if(size_ == Capacity)
+            {
+                dropped_++;
+                return;
+            }
+            data_[countAt_]++;
+            data_[size_++] = byte;
+        }
+
+        void clear()
+        {
+            size_ = 0;
+            countAt_ = kNoRecord;
+            dropped_ = 0;
+            frozen_ = false;
+        }
+
+        void freeze() { frozen_ = true; } // stops recording until clear(), e.g. while it is read out
+
+        const uint8_t* data() const { return data_; }
+        size_t size() const { return size_; }
+        unsigned long dropped() const { return dropped_; } // bytes that arrived after it filled up
+
+    private:
+        static constexpr size_t kNoRecord = SIZE_MAX;
+        uint8_t data_[Capacity];
+        size_t size_ = 0;
+        size_t countAt_ = kNoRecord; // count byte of the open record
+        unsigned long lastMs_ = 0;
+        unsigned long dropped_ = 0;
+        bool frozen_ = false;
+    };
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+
+// Fixed-capacity, null-terminated character buffer (no heap), used for bus frames
+template<size_t Capacity>
+class FixedBuffer
+{
+public:
+    bool push_back(char c)
+    {
+        if (size_ >= Capacity) return false;
+        data_[size_++] = c;
+        data_[size_] = '\0';
+        return true;
+    }
+
+    bool assign(const char* str, size_t length)
+    {
+        if (length > Capacity) return false;
+        std::memcpy(data_, str, length);
+        size_ = length;
+        data_[size_] = '\0';
+        return true;
+    }
+
+    bool assign(std::string_view str) { return assign(str.data(), str.size()); }
+
+    bool append(std::string_view str)
+    {
+        if (str.size() > Capacity - size_) return false;
+        std::memcpy(data_ + size_, str.data(), str.size());
+        size_ += str.size();
+        data_[size_] = '\0';
+        return true;
+    }
+
+    // for writers that fill data() directly (e.g. serializeJson), then report the length
+    bool resize(size_t length)
+    {
+        if (length > Capacity) return false;
+        size_ = length;
+        data_[size_] = '\0';
+        return true;
+    }
+
+    void clear()
+    {
+        size_ = 0;
+        data_[0] = '\0';
+    }
+
+    char* data() { return data_; }
+    const char* data() const { return data_; }
+    const char* c_str() const { return data_; }
+    std::string_view view() const { return std::string_view(data_, size_); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == Capacity; }
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    char data_[Capacity + 1] = {0};
+    size_t size_ = 0;
+};
@@ -0,0 +1,198 @@
+#pragma once
+#include <Arduino.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "FusionBusBinary.hpp"
+
+// Append-only record journal over two flash pages. Each store() programs the next blank
+// slot of the active page; only when it is full the other page is erased and takes over,
+// so a page is erased once per (FLASH_PAGE_SIZE / slot size) stores and the two pages
+// wear evenly. Records carry a format version, a sequence number and a CRC16, so a torn
+// write or a record from an older firmware is skipped and the newest valid one wins.
+// Flash programming stalls the CPU (a page erase for ~20 ms, kEraseStallMaxMs at worst),
+// call store() while idle.
+// Marks are halfwords at the end of each slot that store() leaves erased: mark() programs
+// one on the newest record in place, a single halfword write (~50 us) without an erase or
+// a new slot, e.g. to void part of the record while it is out of date.
+template<typename Record, uint16_t Version, size_t Marks = 0>
+class FlashJournal
+{
+public:
+    static constexpr unsigned long kEraseStallMaxMs = 40; // STM32F103 datasheet, page erase time max
+    // firstPage and the page after it must be reserved for this journal
+    explicit FlashJournal(uintptr_t firstPage): firstPage_(firstPage) {}
+
+    // scans both pages, returns false when no valid record exists (first boot / new format)
+    bool load(Record& record)
+    {
+        hasLatest_ = false;
+        for (uint32_t page = 0; page < 2; page++)
+        {
+            for (size_t slot = 0; slot < kSlotsPerPage; slot++)
+            {
+                Entry entry;
+                std::memcpy(&entry, reinterpret_cast<const void*>(slotAddress(page, slot)), sizeof(entry));
+                if (!valid(entry)) continue;
+                if (!hasLatest_ or (int32_t)(entry.sequence - latest_.sequence) > 0)
+                {
+                    latest_ = entry;
+                    activePage_ = page;
+                    latestSlot_ = slot;
+                    hasLatest_ = true;
+                }
+            }
+        }
+        nextSlot_ = hasLatest_ ? firstBlankSlot(activePage_) : firstBlankSlot(0);
+        if (!hasLatest_) activePage_ = 0;
+        if (hasLatest_) record = latest_.record;
+        return hasLatest_;
+    }
+
+    // writes only when the record differs from the newest stored one or that one is marked
+    bool store(const Record& record)
+    {
+        if (hasLatest_ and !anyMarked() and std::memcmp(&latest_.record, &record, sizeof(Record)) == 0) 
+            return true;
+
+        Entry entry;
+        std::memset(&entry, 0xFF, sizeof(entry));
+        entry.magic = kMagic;
+        entry.version = Version;
+        entry.sequence = hasLatest_ ? latest_.sequence + 1 : 0;
+        entry.record = record;
+        entry.crc = crc(entry);
+
+        if (nextSlot_ >= kSlotsPerPage or !blank(activePage_, nextSlot_))
+        {
+            // active page used up (or holds foreign data): continue on the other one
+            const uint32_t page = hasLatest_ ? 1 - activePage_ : activePage_;
+            if (!erase(page)) return false;
+            activePage_ = page;
+            nextSlot_ = 0;
+        }
+        const bool ok = program(slotAddress(activePage_, nextSlot_), entry);
+        nextSlot_++; // a failed or torn slot stays unusable until the page is erased
+        if (!ok) return false;
+        latest_ = entry;
+        latestSlot_ = nextSlot_ - 1;
+        hasLatest_ = true;
+        return true;
+    }
+
+    // programs mark index on the newest record; false without one
+    bool mark(size_t index)
+    {
+        static_assert(Marks > 0, "FlashJournal without marks");
+        if (!hasLatest_ or index >= Marks) return false;
+        if (marked(index)) return true;
+        HAL_FLASH_Unlock();
+        const bool ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, markAddress(index), 0x0000) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+
+    // mark index of the newest record, as loaded or stored
+    bool marked(size_t index) const
+    {
+        if (!hasLatest_ or index >= Marks) return false;
+        uint16_t mark;
+        std::memcpy(&mark, reinterpret_cast<const void*>(markAddress(index)), sizeof(mark));
+        return mark != 0xFFFF;
+    }
+
+    static constexpr size_t slotSize() { return kSlotSize; }
+
+private:
+    static constexpr uint16_t kMagic = 0xF1A5;
+
+    struct __attribute__((packed)) Entry
+    {
+        uint16_t magic;
+        uint16_t version;
+        uint32_t sequence;
+        Record record;
+        uint16_t crc; // over everything above
+    };
+    static constexpr size_t kEntrySize = (sizeof(Entry) + 1) & ~size_t(1); // programmed in halfwords
+    static constexpr size_t kSlotSize = kEntrySize + 2 * Marks; // the marks follow the entry
+    static constexpr size_t kSlotsPerPage = FLASH_PAGE_SIZE / kSlotSize;
+    static_assert(kSlotsPerPage >= 2, "Record too large for a journal page");
+
+    uintptr_t slotAddress(uint32_t page, size_t slot) const
+    {
+        return firstPage_ + page * FLASH_PAGE_SIZE + slot * kSlotSize;
+    }
+
+    uintptr_t markAddress(size_t index) const
+    {
+        return slotAddress(activePage_, latestSlot_) + kEntrySize + 2 * index;
+    }
+
+    bool anyMarked() const
+    {
+        for (size_t i = 0; i < Marks; i++)
+            if (marked(i)) return true;
+        return false;
+    }
+
+    static uint16_t crc(const Entry& entry)
+    {
+        return FusionBusBinary::crc16(reinterpret_cast<const uint8_t*>(&entry), offsetof(Entry, crc));
+    }
+
+    static bool valid(const Entry& entry)
+    {
+        return entry.magic == kMagic and entry.version == Version and entry.crc == crc(entry);
+    }
+
+    bool blank(uint32_t page, size_t slot) const
+    {
+        const uint8_t* cell = reinterpret_cast<const uint8_t*>(slotAddress(page, slot));
+        for (size_t i = 0; i < kSlotSize; i++)
+            if (cell[i] != 0xFF) return false;
+        return true;
+    }
+
+    // slot after the last used one, so records keep their order within a page
+    size_t firstBlankSlot(uint32_t page) const
+    {
+        size_t slot = kSlotsPerPage;
+        while (slot > 0 and blank(page, slot - 1)) slot--;
+        return slot;
+    }
+
+    bool erase(uint32_t page)
+    {
+        FLASH_EraseInitTypeDef init = {};
+        init.TypeErase = FLASH_TYPEERASE_PAGES;
+        init.Banks = FLASH_BANK_1;
+        init.PageAddress = firstPage_ + page * FLASH_PAGE_SIZE;
+        init.NbPages = 1;
+        uint32_t pageError = 0;
+        HAL_FLASH_Unlock();
+        const bool ok = HAL_FLASHEx_Erase(&init, &pageError) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+
+    bool program(uintptr_t address, const Entry& entry)
+    {
+        uint8_t bytes[kEntrySize];
+        std::memset(bytes, 0xFF, sizeof(bytes));
+        std::memcpy(bytes, &entry, sizeof(entry));
+        bool ok = true;
+        HAL_FLASH_Unlock();
+        for (size_t i = 0; ok and i < kEntrySize; i += 2) // the marks stay erased
+            ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, bytes[i] | (bytes[i + 1] << 8)) == HAL_OK;
+        HAL_FLASH_Lock();
+        return ok;
+    }
+
+    const uintptr_t firstPage_;
+    Entry latest_;
+    bool hasLatest_ = false;
+    size_t latestSlot_ = 0; // on activePage_
+    uint32_t activePage_ = 0;
+    size_t nextSlot_ = 0;
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Compact binary FusionBus protocol, used once a device has been switched over with
+// a text {"id":..,"binary":true} command. On the wire every message is
+// COBS(payload + CRC16 little-endian) between two 0x00 delimiters. Text frames never
+// contain 0x00: a receiver drops what it collected at a text trigger and starts a frame
+// again at the leading delimiter.
+namespace FusionBusBinary
+{
+    constexpr uint8_t kVersion = 1;
+    constexpr uint8_t kDelimiter = 0x00;
+    constexpr uint8_t kUnknownPercent = 0xFF; // position not known (not homed / error)
+
+    enum class Opcode : uint8_t
+    {
+        Command = 1, // master -> device
+        Status = 2   // device -> master
+    };
+
+    // Command::flags
+    constexpr uint8_t kSetVentingPercent = 0x01;
+    constexpr uint8_t kAutoHome = 0x02;
+    constexpr uint8_t kTextMode = 0x80; // switch back to the text protocol after replying
+
+    struct __attribute__((packed)) Command
+    {
+        uint8_t version;
+        uint8_t opcode;
+        uint32_t id;
+        uint8_t flags;
+        uint8_t ventingPercent;
+    };
+
+    struct __attribute__((packed)) Status
+    {
+        uint8_t version;
+        uint8_t opcode;
+        uint32_t id;
+        uint8_t state; // MotionVisorState
+        uint8_t ventingPercent;
+    };
+
+    // CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF)
+    inline uint16_t crc16(const uint8_t* data, size_t size)
+    {
+        uint16_t crc = 0xFFFF;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc ^= static_cast<uint16_t>(data[i]) << 8;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+        }
+        return crc;
+    }
+}
@@ -1,356 +1,772 @@
-#pragma once
-#include <Arduino.h>
-#include <string>
-#include <functional>
-#include <cctype>
-#include <cstdint>
-#include <cstring>
-#include <HardwareSerial.h>
-#include <optional>
-
-class FusionBusSlave 
-{
-public:
-    enum class State 
-    {
-        Idle,           // Waiting for "FusionBus"
-        WaitCommand,    // After "FusionBus", waiting for "Pair" or "Communicate"
-        WaitJsonStart,  // After "FusionBusCommunicate", waiting for '{'
-        CaptureJson,    // Capturing JSON until matching '}'
-        Respond         // Sending response (Pair or callback result)
-    };
-    using Callback = std::function<std::optional<std::string>(const std::string&)>;
-    using PairingCallback = std::function<std::optional<std::string>()>;
-
-    struct Timeouts 
-    {
-        unsigned long primaryTriggerMs   = 150;
-        unsigned long commandTriggerMs   = 150;
-        unsigned long jsonStartMs        = 150;
-        unsigned long jsonCompleteMs     = 250;
-    };
-
-    FusionBusSlave(std::string deviceType = "Ventdrive",
-                   Callback onCommunicate = {})
-        : serial_(HardwareSerial(USART1)),
-          deviceType_(std::move(deviceType)),
-          timeouts_(),
-          onCommunicate_(std::move(onCommunicate))
-    {}
-
-    void begin(unsigned long baud = 115200) 
-    {
-        serial_.begin(baud);
-        USART1->CR3 |= USART_CR3_HDSEL;
-        serial_.println("abcdefghijklmnopqrstuvwxyz1234567890{}[]()!@#$%^&*~,.-_/''<>ABCDEFGHIJKLMNOPQRSTUVWXYZ");
-        reset();
-        // Serial.println("[FusionBusSlave] begin() called, state reset to Idle");
-    }
-
-    void loop() 
-    {
-        uartRecoverIfNeeded();
-        while (serial_.available()) 
-        {
-            const char c = static_cast<char>(serial_.read());
-            processChar(c);
-        }
-        checkTimeouts();
-        flushRespondIfPending();
-    }
-
-    static inline void uartRecoverIfNeeded() 
-    {
-        uint32_t sr = USART1->SR;
-
-        if (sr & (USART_SR_ORE | USART_SR_FE | USART_SR_NE | USART_SR_PE)) 
-        {
-            volatile uint32_t dummy;
-            dummy = sr;           // read SR first
-            dummy = USART1->DR;   // read DR clears the error
-            (void)dummy;
-        }
-    }
-
-
-    void onCommunicate(Callback cb) 
-    {
-        onCommunicate_ = std::move(cb);
-    }
-
-    void onPair(PairingCallback cb) 
-    {
-        onPair_ = std::move(cb);
-    }
-
-    void setDeviceType(std::string type) 
-    {
-        deviceType_ = std::move(type);
-    }
-
-    void setTimeouts(const Timeouts& t) 
-    {
-        timeouts_ = t;
-    }
-
-private:
-    HardwareSerial serial_;
-    std::string deviceType_;
-    Timeouts timeouts_;
-    Callback onCommunicate_;
-    PairingCallback onPair_;
-
-    State state_ = State::Idle;
-
-    std::string tokenBuffer_;
-    std::string jsonBuffer_;
-
-    unsigned long stateStartMs_ = 0;
-    int braceDepth_ = 0;
-
-    std::string pendingResponse_;
-    bool hasPendingResponse_ = false;
-
-    static constexpr const char* kPrimary = "FusionBus";
-    static constexpr const char* kPair    = "Pair";
-    static constexpr const char* kComm    = "Communicate";
-
-    void processChar(char c) 
-    {
-        switch (state_) 
-        {
-            case State::Idle:          handleIdle(c); break;
-            case State::WaitCommand:   handleWaitCommand(c); break;
-            case State::WaitJsonStart: handleWaitJsonStart(c); break;
-            case State::CaptureJson:   handleCaptureJson(c); break;
-            case State::Respond:       break;
-        }
-    }
-
-    void handleIdle(char c) 
-    {
-        if (std::isspace(static_cast<unsigned char>(c))) return;
-        tokenBuffer_.push_back(c);
-
-        if (startsWith(kPrimary)) 
-        {
-            if (tokenBuffer_.size() == std::strlen(kPrimary)) 
-            {
-                // Serial.println("[FusionBusSlave] Primary trigger matched: FusionBus");
-                transition(State::WaitCommand);
-                tokenBuffer_.clear();
-            }
-        } else 
-        {
-            if (c == kPrimary[0]) 
-            {
-                tokenBuffer_.assign(1, c);
-            } else 
-            {
-                tokenBuffer_.clear();
-            }
-        }
-    }
-
-    void handleWaitCommand(char c) 
-    {
-        if (std::isspace(static_cast<unsigned char>(c))) return;
-        tokenBuffer_.push_back(c);
-
-        if (startsWith(kPair)) 
-        {
-            if (tokenBuffer_.size() == std::strlen(kPair)) 
-            {
-                // Serial.println("[FusionBusSlave] Command trigger matched: Pair");
-                if (onPair_) 
-                {
-                    auto optResponse = onPair_();
-                    if(optResponse.has_value())
-                    {
-                        pendingResponse_ = optResponse.value();
-                        hasPendingResponse_ = true;
-                        delay(10); // wait 10ms to avoid bus collision
-                        transition(State::Respond);
-                    }
-                    else
-                    {
-                        reset();
-                    }
-                }
-                return;
-            }
-        } else if (startsWith(kComm)) 
-        {
-            if (tokenBuffer_.size() == std::strlen(kComm)) 
-            {
-                // Serial.println("[FusionBusSlave] Command trigger matched: Communicate");
-                transition(State::WaitJsonStart);
-                tokenBuffer_.clear();
-                return;
-            }
-        } else 
-        {
-            if (c == kPair[0]) 
-            {
-                tokenBuffer_.assign(1, c);
-            } else if (c == kComm[0]) 
-            {
-                tokenBuffer_.assign(1, c);
-            } else 
-            {
-                tokenBuffer_.clear();
-            }
-        }
-    }
-
-    void handleWaitJsonStart(char c) 
-    {
-        if (c == '{') 
-        {
-            // Serial.println("[FusionBusSlave] JSON start detected");
-            jsonBuffer_.clear();
-            jsonBuffer_.push_back(c);
-            braceDepth_ = 1;
-            transition(State::CaptureJson);
-        }
-    }
-
-    void handleCaptureJson(char c) 
-    {
-        jsonBuffer_.push_back(c);
-        if (c == '{') 
-        {
-            ++braceDepth_;
-        } else if (c == '}') 
-        {
-            --braceDepth_;
-            if (braceDepth_ <= 0) 
-            {
-                // Serial.print("[FusionBusSlave] JSON captured: ");
-                // Serial.println(jsonBuffer_.c_str());
-                if (onCommunicate_) 
-                {
-                    auto optResponse = onCommunicate_(jsonBuffer_);
-                    if(optResponse.has_value())
-                    {
-                        pendingResponse_ = optResponse.value();
-                        hasPendingResponse_ = true;
-                        delay(10); // wait to avoid bus collision
-                        transition(State::Respond);
-                    }
-                    else
-                    {
-                        reset();
-                    }
-                }
-            }
-        }
-    }
-
-    bool startsWith(const char* target) const 
-    {
-        const size_t n = tokenBuffer_.size();
-        const size_t m = std::strlen(target);
-        if (n > m) return false;
-        for (size_t i = 0; i < n; ++i) 
-        {
-            if (tokenBuffer_[i] != target[i]) return false;
-        }
-        return true;
-    }
-
-    void transition(State next) 
-    {
-        // Serial.print("[FusionBusSlave] Transition: ");
-        // Serial.print(static_cast<int>(state_));
-        // Serial.print(" -> ");
-        // Serial.println(static_cast<int>(next));
-        state_ = next;
-        stateStartMs_ = millis();
-    }
-
-    void reset() 
-    {
-        // Serial.println("[FusionBusSlave] Resetting state to Idle");
-        state_ = State::Idle;
-        tokenBuffer_.clear();
-        jsonBuffer_.clear();
-        braceDepth_ = 0;
-        hasPendingResponse_ = false;
-        pendingResponse_.clear();
-        stateStartMs_ = millis();
-    }
-
-    void checkTimeouts() 
-    {
-        const unsigned long now = millis();
-        switch (state_) 
-        {
-            case State::Idle:
-                if (elapsed(now) > timeouts_.primaryTriggerMs) 
-                {
-                    tokenBuffer_.clear();
-                    stateStartMs_ = now;
-                }
-                break;
-            case State::WaitCommand:
-                if (elapsed(now) > timeouts_.commandTriggerMs) 
-                {
-                    // Serial.println("[FusionBusSlave] Timeout in WaitCommand");
-                    reset();
-                }
-                break;
-            case State::WaitJsonStart:
-                if (elapsed(now) > timeouts_.jsonStartMs) 
-                {
-                    // Serial.println("[FusionBusSlave] Timeout waiting for JSON start");
-                    reset();
-                }
-                break;
-            case State::CaptureJson:
-                if (elapsed(now) > timeouts_.jsonCompleteMs) 
-                {
-                    // Serial.println("[FusionBusSlave] Timeout capturing JSON");
-                    reset();
-                }
-                break;
-            case State::Respond:
-                break;
-        }
-    }
-
-    unsigned long elapsed(unsigned long now) const 
-    {
-        return now - stateStartMs_;
-    }
-
-    void flushRespondIfPending() 
-    {
-        if (state_ == State::Respond && hasPendingResponse_) 
-        {
-            // Serial.print("[FusionBusSlave] Sending response: ");
-            // Serial.println(pendingResponse_.c_str());
-            serial_.flush();
-            if(serial_.availableForWrite())
-            {
-                serial_.println(pendingResponse_.c_str());
-                hasPendingResponse_ = false;
-                pendingResponse_.clear();
-                reset();
-            }
-        }
-    }
-
-    std::string makeUuid() const 
-    {
-        const uint32_t a = millis();
-        const uint32_t b = micros();
-        const uintptr_t p = reinterpret_cast<uintptr_t>(this);
-        char buf[33] = {0};
-        snprintf(buf, sizeof(buf), "%08lx%08lx%08lx",
-                 static_cast<unsigned long>(a),
-                 static_cast<unsigned long>(b),
-                 static_cast<unsigned long>(p & 0xFFFFFFFFUL));
-        return std::string(buf);
-    }
-};
\ No newline at end of file
+#pragma once
+#include <Arduino.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <HardwareSerial.h>
+#include <optional>
+#include "FixedBuffer.hpp"
+#include "FusionBusBinary.hpp"
+#include "RuntimeStats.hpp"
+#include <Encoding/COBS.h>
+#ifdef FUSIONBUS_DMA_RX
+#include "UartDmaRx.hpp"
+#endif
+#ifdef FUSIONBUS_CAPTURE
+#include "BusCapture.hpp"
+#endif
+
+// JsonCapacity bounds a captured Communicate frame, ResponseCapacity a reply;
+// both live inside the object so the receive path never touches the heap.
+template<size_t JsonCapacity, size_t ResponseCapacity>
+class BasicFusionBusSlave 
+{
+public:
+    enum class State 
+    {
+        Idle,           // Waiting for "FusionBus"
+        WaitCommand,    // After "FusionBus", waiting for "Pair" or "Communicate"
+        WaitJsonStart,  // After "FusionBusCommunicate", waiting for '{'
+        CaptureJson,    // Capturing JSON until matching '}'
+        SkipJson,       // Frame addressed to another id, discarding until matching '}'
+        Respond,        // Response ready, waiting out the turnaround guard time
+        Transmit        // Response queued to the UART, waiting for TX-complete to release the bus
+    };
+    static_assert(static_cast<size_t>(State::Transmit) < RuntimeStats::kBusStates, "RuntimeStats counts timeouts per State");
+    using Response = FixedBuffer<ResponseCapacity>;
+    // fill response and return true to reply, return false to stay silent
+    using Callback = std::function<bool(std::string_view json, Response& response)>;
+    using PairingCallback = std::function<bool(Response& response)>;
+    // decoded, CRC-checked binary payload; fill response with the raw reply payload
+    using BinaryCallback = std::function<bool(const uint8_t* payload, size_t size, Response& response)>;
+    // return true if a frame carrying this top-level "id" is meant for this device
+    using AddressFilter = std::function<bool(uint32_t id)>;
+
+    struct Timeouts 
+    {
+        unsigned long primaryTriggerMs   = 150;
+        unsigned long commandTriggerMs   = 150;
+        unsigned long jsonStartMs        = 150;
+        unsigned long jsonCompleteMs     = 250; // at least a full JsonCapacity frame's airtime plus jsonStartMs
+        unsigned long turnaroundGuardMs  = 10;  // quiet time before replying, avoids bus collision
+        unsigned long transmitCompleteMs = 500; // give up waiting for TX-complete after this
+    };
+
+    BasicFusionBusSlave(std::string deviceType = "Ventdrive",
+                        Callback onCommunicate = {})
+        : serial_(HardwareSerial(USART1)),
+          deviceType_(std::move(deviceType)),
+          timeouts_(),
+          onCommunicate_(std::move(onCommunicate))
+    {}
+
+    void begin(unsigned long baud = 115200) 
+    {
+        openPort(baud);
+        serial_.println("abcdefghijklmnopqrstuvwxyz1234567890{}[]()!@#$%^&*~,.-_/''<>ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+        reset();
+        // Serial.println("[FusionBusSlave] begin() called, state reset to Idle");
+    }
+
+    void loop() 
+    {
+        uartRecoverIfNeeded();
+#ifdef FUSIONBUS_DMA_RX
+        dmaRx_.poll([this](const uint8_t* data, size_t size) { processChunk(data, size); });
+#else
+        while (serial_.available()) 
+        {
+            processByte(static_cast<uint8_t>(serial_.read()));
+        }
+#endif
+        service();
+    }
+
+    // Host replay of captured traffic (test/test_replay): the bytes take the path loop()
+    // hands them, then the timeouts and a due reply run at the current millis()
+    void replay(const uint8_t* data, size_t size) 
+    {
+        processChunk(data, size);
+        service();
+    }
+
+    static inline void uartRecoverIfNeeded() 
+    {
+        uint32_t sr = USART1->SR;
+#ifdef FUSIONBUS_DMA_RX
+        // DMA1 channel 5 owns DR: a CPU read here could take a byte from the ring. The
+        // DMA's next DR read after this SR read clears the flags, so count each only
+        // when it first shows up.
+        static uint32_t seen = 0;
+        const uint32_t errors = sr & (USART_SR_ORE | USART_SR_FE | USART_SR_NE | USART_SR_PE);
+        countUartErrors(errors & ~seen);
+        seen = errors;
+#else
+        if (sr & (USART_SR_ORE | USART_SR_FE | USART_SR_NE | USART_SR_PE)) 
+        {
+            countUartErrors(sr);
+            volatile uint32_t dummy;
+            dummy = sr;           // read SR first
+            dummy = USART1->DR;   // read DR clears the error
+            (void)dummy;
+        }
+#endif
+    }
+
+
+    unsigned long baud() const
+    {
+        return baud_;
+    }
+
+    // Switches the line rate without the banner; call between frames, with no reply
+    // pending. Whatever is mid-frame is dropped, as at any rate mismatch.
+    void setBaud(unsigned long baud) 
+    {
+#ifdef FUSIONBUS_DMA_RX
+        dmaRx_.end();
+#endif
+        serial_.end();
+        openPort(baud);
+        reset();
+    }
+
+    // millis() when the last frame for any device started: the line runs at our rate
+    unsigned long lastFrameMs() const
+    {
+        return lastFrameMs_;
+    }
+
+    // called from a callback: send the reply this much later than the turnaround
+    // guard, e.g. in the device's slot of a slotted poll
+    void deferResponse(unsigned long delayMs) 
+    {
+        responseDelayMs_ = delayMs;
+    }
+
+    void onCommunicate(Callback cb) 
+    {
+        onCommunicate_ = std::move(cb);
+    }
+
+    void onPair(PairingCallback cb) 
+    {
+        onPair_ = std::move(cb);
+    }
+
+    void onBinary(BinaryCallback cb) 
+    {
+        onBinary_ = std::move(cb);
+    }
+
+    // accept COBS+CRC binary frames in addition to text; negotiated per device
+    void setBinaryMode(bool enabled) 
+    {
+        binaryMode_ = enabled;
+        binaryLength_ = 0;
+        binaryOverflow_ = false;
+        binarySynced_ = false;
+    }
+
+    bool binaryMode() const
+    {
+        return binaryMode_;
+    }
+
+    // frames whose top-level numeric "id" fails the filter are skipped while they
+    // arrive, without being stored or handed to onCommunicate
+    void setAddressFilter(AddressFilter filter) 
+    {
+        addressFilter_ = std::move(filter);
+    }
+
+    void setDeviceType(std::string type) 
+    {
+        deviceType_ = std::move(type);
+    }
+
+    void setTimeouts(const Timeouts& t) 
+    {
+        timeouts_ = t;
+    }
+
+    // Communicate frames dropped because they did not fit in JsonCapacity
+    unsigned long oversizedFrames() const
+    {
+        return oversizedFrames_;
+    }
+
+    // Communicate frames skipped because their "id" failed the address filter
+    unsigned long foreignFrames() const
+    {
+        return foreignFrames_;
+    }
+
+    // binary frames rejected by COBS decoding, length or CRC
+    unsigned long corruptFrames() const
+    {
+        return corruptFrames_;
+    }
+
+    // partial frames given up in this state after its Timeouts entry ran out
+    unsigned long timeoutHits(State state) const
+    {
+        return timeoutHits_[static_cast<size_t>(state)];
+    }
+
+    // FUSIONBUS_DMA_RX receive ring, filled while the main loop stalls: ~44 ms of a
+    // saturated line at 230400 baud, ~270 ms at 38400
+    static constexpr size_t kDmaRxSize = 1024;
+
+#ifdef FUSIONBUS_CAPTURE
+    static constexpr size_t kCaptureSize = 2048; // ~1.3 s of a saturated line at 38400 baud, longer with pauses
+    using Capture = BusCapture::Recorder<kCaptureSize>;
+
+    // every received byte with its millis(), read out with the "capture" query
+    Capture& capture()
+    {
+        return capture_;
+    }
+#endif
+
+private:
+    static void countUartErrors(uint32_t sr) 
+    {
+        if (sr & USART_SR_ORE) RuntimeStats::count(RuntimeStats::Counter::UartOverrun);
+        if (sr & USART_SR_FE) RuntimeStats::count(RuntimeStats::Counter::UartFraming);
+        if (sr & USART_SR_NE) RuntimeStats::count(RuntimeStats::Counter::UartNoise);
+        if (sr & USART_SR_PE) RuntimeStats::count(RuntimeStats::Counter::UartParity);
+    }
+
+    HardwareSerial serial_;
+#ifdef FUSIONBUS_DMA_RX
+    UartDmaRx<kDmaRxSize> dmaRx_;
+#endif
+    std::string deviceType_;
+    Timeouts timeouts_;
+    unsigned long baud_ = 0;
+    unsigned long frameAirtimeMs_ = 0; // a JsonCapacity frame on the wire, 267 ms at 38400 baud
+    unsigned long lastFrameMs_ = 0;
+    Callback onCommunicate_;
+    PairingCallback onPair_;
+    BinaryCallback onBinary_;
+    AddressFilter addressFilter_;
+
+    // Matches a keyword one character at a time, whitespace is skipped by the caller
+    struct TokenMatcher
+    {
+        const char* token;
+        size_t length;
+        size_t matched = 0;
+
+        // returns true when the last character of the token arrives
+        bool feed(char c)
+        {
+            if (c == token[matched])
+            {
+                if (++matched < length) return false;
+                matched = 0;
+                return true;
+            }
+            matched = (c == token[0]) ? 1 : 0; // restart, the keywords never overlap themselves
+            return false;
+        }
+
+        void reset() { matched = 0; }
+    };
+
+    // Follows JSON structure one character at a time: nesting depth, strings, and the
+    // numeric value of the top-level "id" key as soon as its last digit has arrived
+    struct FrameScanner
+    {
+        enum class IdState : uint8_t { None, AfterKey, BeforeValue, InValue, Done };
+
+        int depth = 0;
+        bool inString = false;
+        bool escaped = false;
+        bool expectKey = false; // next string at depth 1 is a key
+        bool inKey = false;
+        uint8_t keyMatched = 0; // characters of "id" matched, kNoMatch once the key differs
+        IdState idState = IdState::None;
+        uint32_t id = 0;
+        bool idReady = false; // true only for the character that completed the id
+
+        static constexpr uint8_t kNoMatch = 0xFF;
+
+        // call with the opening '{' already consumed
+        void begin()
+        {
+            *this = FrameScanner();
+            depth = 1;
+            expectKey = true;
+        }
+
+        void feed(char c)
+        {
+            idReady = false;
+            if (inString)
+            {
+                if (escaped) escaped = false;
+                else if (c == '\\') escaped = true;
+                else if (c == '"')
+                {
+                    inString = false;
+                    if (inKey)
+                    {
+                        inKey = false;
+                        if (keyMatched == 2 && idState == IdState::None) idState = IdState::AfterKey;
+                    }
+                }
+                else if (inKey)
+                {
+                    keyMatched = (keyMatched < 2 && c == "id"[keyMatched]) ? keyMatched + 1 : kNoMatch;
+                }
+                return;
+            }
+            if (idState == IdState::InValue)
+            {
+                if (c >= '0' && c <= '9')
+                {
+                    id = id * 10 + static_cast<uint32_t>(c - '0');
+                    return;
+                }
+                idState = IdState::Done;
+                idReady = true;
+            }
+            else if (idState == IdState::BeforeValue && !std::isspace(static_cast<unsigned char>(c)))
+            {
+                if (c >= '0' && c <= '9')
+                {
+                    id = static_cast<uint32_t>(c - '0');
+                    idState = IdState::InValue;
+                    return;
+                }
+                idState = IdState::Done; // not a plain number, leave it to the JSON parser
+            }
+            switch (c)
+            {
+                case '"':
+                    inString = true;
+                    if (depth == 1 && expectKey)
+                    {
+                        inKey = true;
+                        keyMatched = 0;
+                        expectKey = false;
+                    }
+                    break;
+                case '{': case '[': ++depth; break;
+                case '}': case ']': --depth; break;
+                case ',': if (depth == 1) expectKey = true; break;
+                case ':': if (idState == IdState::AfterKey) idState = IdState::BeforeValue; break;
+                default: break;
+            }
+        }
+    };
+
+    static constexpr char kPrimary[] = "FusionBus";
+    static constexpr char kPair[]    = "Pair";
+    static constexpr char kComm[]    = "Communicate";
+
+    State state_ = State::Idle;
+
+    TokenMatcher primaryMatcher_{kPrimary, sizeof(kPrimary) - 1};
+    TokenMatcher pairMatcher_{kPair, sizeof(kPair) - 1};
+    TokenMatcher commMatcher_{kComm, sizeof(kComm) - 1};
+    FixedBuffer<JsonCapacity> jsonBuffer_;
+    FrameScanner scanner_;
+
+    unsigned long stateStartMs_ = 0;
+    unsigned long oversizedFrames_ = 0;
+    unsigned long foreignFrames_ = 0;
+    unsigned long timeoutHits_[static_cast<size_t>(State::Transmit) + 1] = {};
+#ifdef FUSIONBUS_CAPTURE
+    Capture capture_;
+#endif
+
+    Response pendingResponse_;
+    bool hasPendingResponse_ = false;
+    bool pendingBinary_ = false; // pendingResponse_ holds a COBS frame, not a text line
+    unsigned long responseDelayMs_ = 0; // extra wait before replying, see deferResponse()
+    size_t echoRemaining_ = 0; // bytes of the reply in flight not yet heard back
+
+    static constexpr size_t kBinaryCapacity = 64; // encoded frame, delimiter excluded
+    bool binaryMode_ = false;
+    uint8_t binaryBuffer_[kBinaryCapacity];
+    size_t binaryLength_ = 0;
+    bool binaryOverflow_ = false;
+    bool binarySynced_ = false; // a delimiter came after the last text trigger, the bytes since belong to a frame
+    unsigned long corruptFrames_ = 0;
+
+    void processByte(uint8_t b) 
+    {
+#ifdef FUSIONBUS_CAPTURE
+        capture_.record(b, millis()); // the line as received, our own echo included
+#endif
+        if (state_ == State::Respond) return;
+        if (state_ == State::Transmit)
+        {
+            // our reply comes back through the half-duplex loopback byte for byte, whatever
+            // follows its last byte is the next frame and is parsed right away
+            if (echoRemaining_ > 0)
+            {
+                if (--echoRemaining_ == 0) reset();
+                return;
+            }
+            reset();
+        }
+        if (binaryMode_) processBinaryByte(b);
+        processChar(static_cast<char>(b)); // the text protocol stays available in binary mode
+    }
+
+    void processChunk(const uint8_t* data, size_t size) 
+    {
+        for (size_t i = 0; i < size; ++i)
+            processByte(data[i]);
+    }
+
+    void processChar(char c) 
+    {
+        switch (state_) 
+        {
+            case State::Idle:          handleIdle(c); break;
+            case State::WaitCommand:   handleWaitCommand(c); break;
+            case State::WaitJsonStart: handleWaitJsonStart(c); break;
+            case State::CaptureJson:   handleCaptureJson(c); break;
+            case State::SkipJson:      handleSkipJson(c); break;
+            case State::Respond:       break;
+            case State::Transmit:      break; // processByte() drops our own half-duplex echo
+        }
+    }
+
+    void handleIdle(char c) 
+    {
+        if (std::isspace(static_cast<unsigned char>(c))) return;
+
+        stateStartMs_ = millis(); // a stale partial trigger is dropped after a quiet primaryTriggerMs, not mid-word
+        if (primaryMatcher_.feed(c)) 
+        {
+            // Serial.println("[FusionBusSlave] Primary trigger matched: FusionBus");
+            // a text frame follows: binary receive waits for the next delimiter, text has no 0x00
+            binaryLength_ = 0;
+            binaryOverflow_ = false;
+            binarySynced_ = false;
+            transition(State::WaitCommand);
+        }
+    }
+
+    void handleWaitCommand(char c) 
+    {
+        if (std::isspace(static_cast<unsigned char>(c))) return;
+
+        if (pairMatcher_.feed(c)) 
+        {
+            // Serial.println("[FusionBusSlave] Command trigger matched: Pair");
+            if (onPair_) 
+            {
+                pendingResponse_.clear();
+                if(onPair_(pendingResponse_))
+                {
+                    hasPendingResponse_ = true;
+                    transition(State::Respond);
+                }
+                else
+                {
+                    reset();
+                }
+            }
+            return;
+        }
+        if (commMatcher_.feed(c)) 
+        {
+            // Serial.println("[FusionBusSlave] Command trigger matched: Communicate");
+            transition(State::WaitJsonStart);
+        }
+    }
+
+    void handleWaitJsonStart(char c) 
+    {
+        if (c == '{') 
+        {
+            // Serial.println("[FusionBusSlave] JSON start detected");
+            RuntimeStats::count(RuntimeStats::Counter::FramesSeen);
+            lastFrameMs_ = millis();
+            jsonBuffer_.clear();
+            jsonBuffer_.push_back(c);
+            scanner_.begin();
+            transition(State::CaptureJson);
+        }
+    }
+
+    void handleCaptureJson(char c) 
+    {
+        if (!jsonBuffer_.push_back(c)) 
+        {
+            // Serial.println("[FusionBusSlave] JSON frame exceeds capacity, dropped");
+            ++oversizedFrames_;
+            reset();
+            return;
+        }
+        scanner_.feed(c);
+        if (scanner_.idReady && addressFilter_ && !addressFilter_(scanner_.id)) 
+        {
+            // Serial.println("[FusionBusSlave] Frame for another id, skipping");
+            ++foreignFrames_;
+            if (scanner_.depth <= 0) reset();
+            else state_ = State::SkipJson; // keeps stateStartMs_, the jsonCompleteMs budget still applies
+            return;
+        }
+        if (scanner_.depth <= 0) 
+        {
+            // Serial.print("[FusionBusSlave] JSON captured: ");
+            // Serial.println(jsonBuffer_.c_str());
+            RuntimeStats::count(RuntimeStats::Counter::FramesAddressed);
+            if (onCommunicate_) 
+            {
+                pendingResponse_.clear();
+                if(onCommunicate_(jsonBuffer_.view(), pendingResponse_))
+                {
+                    hasPendingResponse_ = true;
+                    transition(State::Respond);
+                }
+                else
+                {
+                    reset();
+                }
+            }
+        }
+    }
+
+    void handleSkipJson(char c) 
+    {
+        scanner_.feed(c);
+        if (scanner_.depth <= 0) reset();
+    }
+
+    void processBinaryByte(uint8_t b) 
+    {
+        if (b != FusionBusBinary::kDelimiter) 
+        {
+            if (!binarySynced_) return;
+            if (binaryLength_ < kBinaryCapacity) binaryBuffer_[binaryLength_++] = b;
+            else binaryOverflow_ = true;
+            return;
+        }
+        const size_t length = binaryLength_;
+        const bool overflow = binaryOverflow_;
+        binaryLength_ = 0;
+        binaryOverflow_ = false;
+        binarySynced_ = true;
+        if (length == 0) return; // back-to-back delimiters, or the leading one
+        if (overflow) 
+        {
+            ++corruptFrames_;
+            return;
+        }
+
+        uint8_t decoded[kBinaryCapacity];
+        const size_t size = COBS::decode(binaryBuffer_, length, decoded);
+        if (size < 3 || FusionBusBinary::crc16(decoded, size - 2) !=
+            static_cast<uint16_t>(decoded[size - 2] | (decoded[size - 1] << 8))) 
+        {
+            ++corruptFrames_;
+            return;
+        }
+        RuntimeStats::count(RuntimeStats::Counter::FramesSeen);
+        lastFrameMs_ = millis();
+        if (!onBinary_) return;
+
+        Response reply;
+        if (!onBinary_(decoded, size - 2, reply)) return;
+        RuntimeStats::count(RuntimeStats::Counter::FramesAddressed); // onBinary_ checks the id itself
+        if (reply.size() + 2 > kBinaryCapacity) return;
+
+        uint8_t raw[kBinaryCapacity];
+        std::memcpy(raw, reply.data(), reply.size());
+        const uint16_t crc = FusionBusBinary::crc16(raw, reply.size());
+        raw[reply.size()] = static_cast<uint8_t>(crc & 0xFF);
+        raw[reply.size() + 1] = static_cast<uint8_t>(crc >> 8);
+        const size_t encodedSize = COBS::encode(raw, reply.size() + 2, reinterpret_cast<uint8_t*>(pendingResponse_.data()));
+        pendingResponse_.resize(encodedSize);
+        hasPendingResponse_ = true;
+        pendingBinary_ = true;
+        transition(State::Respond);
+    }
+
+    void transition(State next) 
+    {
+        // Serial.print("[FusionBusSlave] Transition: ");
+        // Serial.print(static_cast<int>(state_));
+        // Serial.print(" -> ");
+        // Serial.println(static_cast<int>(next));
+        state_ = next;
+        stateStartMs_ = millis();
+    }
+
+    void reset() 
+    {
+        // Serial.println("[FusionBusSlave] Resetting state to Idle");
+        state_ = State::Idle;
+        primaryMatcher_.reset();
+        pairMatcher_.reset();
+        commMatcher_.reset();
+        jsonBuffer_.clear();
+        scanner_ = FrameScanner();
+        hasPendingResponse_ = false;
+        pendingBinary_ = false;
+        responseDelayMs_ = 0;
+        echoRemaining_ = 0;
+        pendingResponse_.clear();
+        stateStartMs_ = millis();
+    }
+
+    void checkTimeouts() 
+    {
+        const unsigned long now = millis();
+        switch (state_) 
+        {
+            case State::Idle:
+                if (elapsed(now) > timeouts_.primaryTriggerMs) 
+                {
+                    primaryMatcher_.reset();
+                    stateStartMs_ = now;
+                }
+                break;
+            case State::WaitCommand:
+                if (elapsed(now) > timeouts_.commandTriggerMs) 
+                {
+                    // Serial.println("[FusionBusSlave] Timeout in WaitCommand");
+                    countTimeout();
+                    reset();
+                }
+                break;
+            case State::WaitJsonStart:
+                if (elapsed(now) > timeouts_.jsonStartMs) 
+                {
+                    // Serial.println("[FusionBusSlave] Timeout waiting for JSON start");
+                    countTimeout();
+                    reset();
+                }
+                break;
+            case State::CaptureJson:
+            case State::SkipJson:
+                if (elapsed(now) > std::max(timeouts_.jsonCompleteMs, frameAirtimeMs_ + timeouts_.jsonStartMs)) 
+                {
+                    // Serial.println("[FusionBusSlave] Timeout capturing JSON");
+                    countTimeout();
+                    reset();
+                }
+                break;
+            case State::Respond:
+                break;
+            case State::Transmit:
+                if (elapsed(now) > timeouts_.transmitCompleteMs) 
+                {
+                    // Serial.println("[FusionBusSlave] Timeout waiting for TX-complete");
+                    countTimeout();
+                    reset();
+                }
+                break;
+        }
+    }
+
+    void openPort(unsigned long baud) 
+    {
+        baud_ = baud;
+        frameAirtimeMs_ = (JsonCapacity * 10 * 1000 + baud - 1) / baud; // 8N1
+        serial_.begin(baud);
+        USART1->CR3 |= USART_CR3_HDSEL;
+#ifdef FUSIONBUS_DMA_RX
+        dmaRx_.begin();
+#endif
+    }
+
+    void countTimeout() 
+    {
+        ++timeoutHits_[static_cast<size_t>(state_)];
+        RuntimeStats::countTimeout(static_cast<size_t>(state_));
+    }
+
+    unsigned long elapsed(unsigned long now) const 
+    {
+        return now - stateStartMs_;
+    }
+
+    void service() 
+    {
+        checkTimeouts();
+        flushRespondIfPending();
+        releaseBusIfTransmitted();
+    }
+
+    // The reply is queued once the guard time has passed; HardwareSerial sends it from
+    // its TX interrupt, so the main loop never waits on the line.
+    void flushRespondIfPending() 
+    {
+        if (state_ == State::Respond && hasPendingResponse_ && 
+            elapsed(millis()) >= timeouts_.turnaroundGuardMs + responseDelayMs_) 
+        {
+            // Serial.print("[FusionBusSlave] Sending response: ");
+            // Serial.println(pendingResponse_.c_str());
+            const size_t frameSize = pendingResponse_.size() + 2; // delimiters or CRLF
+            if (static_cast<size_t>(serial_.availableForWrite()) >= frameSize)
+            {
+                if (pendingBinary_) 
+                {
+                    serial_.write(FusionBusBinary::kDelimiter);
+                    serial_.write(reinterpret_cast<const uint8_t*>(pendingResponse_.data()), pendingResponse_.size());
+                    serial_.write(FusionBusBinary::kDelimiter);
+                }
+                else 
+                {
+                    serial_.println(pendingResponse_.c_str());
+                }
+                hasPendingResponse_ = false;
+                pendingResponse_.clear();
+                echoRemaining_ = frameSize;
+                transition(State::Transmit);
+            }
+        }
+    }
+
+    // Normally the last echo byte releases the bus in processByte(). If the reply has left
+    // (TX ring drained, shift register empty) and nothing is left to read, the rest of the
+    // echo was lost, e.g. to an overrun, and the line is ours to listen on again.
+    void releaseBusIfTransmitted() 
+    {
+        if (state_ == State::Transmit && 
+            serial_.availableForWrite() >= SERIAL_TX_BUFFER_SIZE - 1 && 
+            (USART1->SR & USART_SR_TC) &&
+            receivedPending() == 0) 
+        {
+            reset();
+        }
+    }
+
+    size_t receivedPending() 
+    {
+#ifdef FUSIONBUS_DMA_RX
+        return dmaRx_.pending();
+#else
+        return static_cast<size_t>(serial_.available());
+#endif
+    }
+
+    std::string makeUuid() const 
+    {
+        const uint32_t a = millis();
+        const uint32_t b = micros();
+        const uintptr_t p = reinterpret_cast<uintptr_t>(this);
+        char buf[33] = {0};
+        snprintf(buf, sizeof(buf), "%08lx%08lx%08lx",
+                 static_cast<unsigned long>(a),
+                 static_cast<unsigned long>(b),
+                 static_cast<unsigned long>(p & 0xFFFFFFFFUL));
+        return std::string(buf);
+    }
+};
+
+using FusionBusSlave = BasicFusionBusSlave<1024, 512>; // 1 KB fits a multicast frame for ~60 vents, 512 B a polled reply for 4 vents (checked in SystemFacade)
@@ -1,156 +1,486 @@
 #include "MotionVisor.hpp"
 #include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 
-MotionVisor::MotionVisor(): timer(TIM3)
+MotionVisor::MotionVisor()
 {
+    setConfig(config);
+    profile = commands.profile; // not attached yet, the interrupt starts out configured
+}
+
+bool MotionVisor::begin(const Pins& pins)
+{
+    dirPin = pins.dir;
+    stepPin = pins.step;
+    enPin = pins.en;
+    endstopPin = pins.endstop;
     pinMode(endstopPin, INPUT_PULLDOWN);
-    pinMode(stepPin, OUTPUT);
     pinMode(dirPin, OUTPUT);
     pinMode(enPin, OUTPUT);
 
-    timer.setOverflow(100, MICROSEC_FORMAT);
-    timer.attachInterrupt(std::bind(&MotionVisor::stepperAsyncLoop, this));
-    timer.resume();
+#ifdef MOTIONVISOR_HW_STEP
+    // TIM3 CH1 drives STEP directly: 1us counter, PWM2 puts the pulse at the end of each period
+    HardwareTimer& timer = StepScheduler::instance().timer();
+    timer.setPrescaleFactor(timer.getTimerClkFreq() / 1000000);
+    timer.setMode(kStepChannel, TIMER_OUTPUT_COMPARE_PWM2, stepPin);
+    timer.setOverflow(kIdlePeriodUs, TICK_FORMAT);
+    timer.setCaptureCompare(kStepChannel, kIdlePeriodUs, TICK_COMPARE_FORMAT); // compare beyond ARR, no pulse
+    TIM3->CR1 &= ~TIM_CR1_ARPE; // period and compare written in the interrupt apply to the running period
+    TIM3->CCMR1 &= ~TIM_CCMR1_OC1PE;
+#else
+    pinMode(stepPin, OUTPUT);
+#endif
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    endstopLevel = digitalRead(endstopPin);
+    endstopPendingLevel = endstopLevel;
+    attachInterrupt(digitalPinToInterrupt(endstopPin), std::bind(&MotionVisor::endstopEdge, this), CHANGE);
+#endif
+    attached = StepScheduler::instance().attach(this);
+    return attached;
+}
+
+uint32_t MotionVisor::stepperAsyncLoop()
+{
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    debounceEndstop();
+#endif
+#ifdef MOTIONVISOR_HW_STEP
+    if(pulseWaitUs > 0) // a step delay longer than one timer period, the planner waits for its pulse
+    {
+        scheduleStepPulse();
+        return std::max(nextDelayQ, kTickQ);
+    }
+#endif
+    // a torn read leaves the commands held so far: the step is planned with those, and the
+    // mailbox is read again on the next run, at the latest on the next tick
+    const bool taken = takeCommands();
+    planStep();
+    if(!taken and nextDelayQ == 0)
+        nextDelayQ = kTickQ;
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    if(nextDelayQ == 0 and endstopPending)
+        nextDelayQ = kTickQ; // stay awake to latch the level
+#endif
+    publishSnapshot();
+#ifdef MOTIONVISOR_HW_STEP
+    scheduleStepPulse();
+#endif
+    return nextDelayQ;
+}
+
+// Adopts what the main loop posted since the last run, oldest kind of request first. The
+// interrupt can't wait for a write it preempted, so a torn read is left for the next run.
+bool MotionVisor::takeCommands()
+{
+    const uint32_t sequence = mailbox.sequence();
+    if(sequence == mailboxSequence)
+        return true;
+    Commands posted;
+    if(!mailbox.tryRead(posted))
+        return false;
+    // homing and a restore decide on the endstop level: while an edge burst is still
+    // debouncing, the latched level may be stale, so the mailbox waits as on a torn read
+    if(!endstopSettled() and (posted.restoreRevision != taken.restoreRevision or posted.homeRevision != taken.homeRevision))
+        return false;
+    mailboxSequence = sequence;
+    if(posted.profileRevision != taken.profileRevision)
+        profile = posted.profile;
+    if(posted.restoreRevision != taken.restoreRevision)
+        takeRestore(posted.restoreStep);
+    if(posted.goalRevision != taken.goalRevision and currentStep.has_value() and !autoHomeFlag and _state != MotionVisorState::Error)
+        goalStep = posted.goalStep;
+    if(posted.homeRevision != taken.homeRevision)
+        startHoming();
+    taken = posted;
+    return true;
 }
 
-void MotionVisor::stepperAsyncLoop()
+// One planner run: homing, moving toward goalStep, or checking the endstop while parked
+void MotionVisor::planStep()
 {
+    if(queueFlushDone != queueFlushRequest)
+    {
+        queueHead = queueFlushTail;
+        queueFlushDone = queueFlushRequest;
+        holdStarted = false;
+    }
     if(autoHomeFlag)
     {
-        static int extraStepsCounter = 0;
-        static int cnt;
-        unsigned long delay = (unsigned long)(10000.0 / (config.speed * config.stepPermm));
         enableStepper();
-        if(cnt++ > delay)
+        // only the slow approach itself is slow, the extra distance past the endstop is counted out at speed
+        const bool slow = homingPhase == HomingPhase::SlowApproach and homingExtraSteps == 0;
+        const uint32_t homingDelayQ = slow ? profile.homingSlowDelayQ : profile.homingFastDelayQ;
+        nextDelayQ = homingDelayQ;
+        if(homingPhase == HomingPhase::BackOff) // move off the endstop, then homingBackoff further
         {
-            if(goalStep < 0 and !isAtEndstop())
+            if(isAtEndstop())
+                homingSteps = 0;
+            else
+                homingSteps++;
+            if(goalStep-- <= 0) // the endstop never released
             {
-                goalStep ++;
-                moveOneStep(Direction::Backward);
+                _state = MotionVisorState::Error;
+                currentStep = std::nullopt;
+                goalStep = 0;
+                autoHomeFlag = false;
+            }
+            else if(homingSteps <= profile.homingBackoffSteps)
+            {
+                moveOneStep(Direction::Forward);
+            }
+            else
+            {
+                homingPhase = HomingPhase::SlowApproach;
+                goalStep = -(profile.homingBackoffSteps + profile.compensationSteps); // travel limit for the slow approach
+            }
+        }
+        else if(goalStep < 0 and !isAtEndstop())
+        {
+            goalStep ++;
+            moveOneStep(Direction::Backward);
+        }
+        else 
+        {
+            if(isAtEndstop() and homingPhase == HomingPhase::FastApproach and profile.homingBackoffSteps > 0)
+            {
+                homingPhase = HomingPhase::BackOff; // tripped at speed, back off and come in slowly for a repeatable edge
+                homingSteps = 0;
+                goalStep = profile.extraDistanceSteps + profile.homingBackoffSteps + profile.compensationSteps; // travel limit for backing off
             }
-            else 
+            else if(isAtEndstop())
             {
-                if(isAtEndstop())
+                if(homingExtraSteps == 0) homingExtraSteps = stepsPastEndstop();
+                if(homingExtraSteps++ > profile.extraDistanceSteps)
                 {
-                    if(extraStepsCounter++ > mmToStep(config.endstopExtraDistance))
-                    {
-                        extraStepsCounter = 0;
-                        _state = MotionVisorState::Idle;
-                        currentStep = 0;
-                        goalStep = 0;
-                        autoHomeFlag = false;
-                    }
-                    else
-                    {
-                        moveOneStep(Direction::Backward); // take extra steps to reach endstopExtraDistance 
-                    }
+                    homingExtraSteps = 0;
+                    _state = MotionVisorState::Idle;
+                    currentStep = 0;
+                    goalStep = 0;
+                    autoHomeFlag = false;
                 }
                 else
                 {
-                    _state = MotionVisorState::Error;
-                    currentStep = std::nullopt;
-                    goalStep = 0;
-                    autoHomeFlag = false;
+                    moveOneStep(Direction::Backward); // take extra steps to reach endstopExtraDistance 
                 }
             }
-            cnt = 0;
+            else
+            {
+                _state = MotionVisorState::Error;
+                currentStep = std::nullopt;
+                goalStep = 0;
+                autoHomeFlag = false;
+            }
         }
     }
     else if(currentStep.has_value())
     {
-        static int extraStepsCounter = 0;
-        static int cnt = 0;
-        // base delay in ticks
-        unsigned long delay = (unsigned long)(10000.0 / (config.speed * config.stepPermm));
-        //auto delay = computeDelayTicks(goalStep, currentStep.value(), totalDistSteps, config.speed, config.stepPermm, config.acceleration);
+        if(currentStep.value() == goalStep)
+            takeNextSegment();
+        const long remaining = goalStep - currentStep.value();
+        Direction travel = remaining >= 0 ? Direction::Forward : Direction::Backward;
+        bool braking = false;
+        if(rampStep > 0 and remaining != 0 and travel != motionDirection) // new target is behind us
+        {
+            if(rampStep > 1) // keep going and slow down before turning around
+            {
+                travel = motionDirection;
+                braking = true;
+            }
+            else
+            {
+                rampStep = 0; // slow enough to reverse
+            }
+        }
+        const long stepsToGo = braking ? 0 : std::abs(remaining) + lookAheadSteps(travel);
+        // a full close continues past the endstop, so don't ramp down before reaching it
+        const long extraSteps = goalStep == 0 ? profile.extraDistanceSteps : 0;
 
-        if(cnt++ > delay) 
+        if(travel == Direction::Forward and (stepsToGo > 0 or braking)) 
+        {
+            nextDelayQ = computeDelayTicks(stepsToGo);
+            enableStepper();
+            moveOneStep(Direction::Forward);
+            currentStep = currentStep.value() + 1;
+            motionDirection = Direction::Forward;
+            _state = MotionVisorState::Opening;
+        } 
+        else if(travel == Direction::Backward and (stepsToGo > 0 or braking) and !isAtEndstop()) 
         {
-            if(currentStep.value() < goalStep) 
+            nextDelayQ = computeDelayTicks(braking ? 0 : stepsToGo + extraSteps);
+            enableStepper();
+            moveOneStep(Direction::Backward);
+            currentStep = currentStep.value() - 1;
+            motionDirection = Direction::Backward;
+            _state = MotionVisorState::Closing;
+        } 
+        else if(isAtEndstop() and _state == MotionVisorState::Closing)
+        {
+            positionUnverified = false; // whatever the checkpoint said, the position is re-zeroed here
+            if(closingExtraSteps == 0) closingExtraSteps = stepsPastEndstop();
+            if(closingExtraSteps++ > profile.extraDistanceSteps)
             {
-                enableStepper();
-                moveOneStep(Direction::Forward);
-                currentStep = currentStep.value() + 1;
-                _state = MotionVisorState::Opening;
-            } 
-            else if(currentStep.value() > goalStep and !isAtEndstop()) 
+                closingExtraSteps = 0;
+                currentStep = 0; // is at home(origin) so currentStep should be zero
+                goalStep = 0;
+                rampStep = 0;
+                _state = MotionVisorState::Idle;
+            }
+            else // rotate an extra step until closingExtraSteps reaches mmToStep(endstopExtraDistance)
             {
+                nextDelayQ = computeDelayTicks(extraSteps - closingExtraSteps);
                 enableStepper();
                 moveOneStep(Direction::Backward);
-                currentStep = currentStep.value() - 1;
-                _state = MotionVisorState::Closing;
-            } 
-            else if(isAtEndstop() and _state == MotionVisorState::Closing)
-            {
-                if(extraStepsCounter++ > mmToStep(config.endstopExtraDistance))
-                {
-                    extraStepsCounter = 0;
-                    currentStep = 0; // is at home(origin) so currentStep should be zero
-                    _state = MotionVisorState::Idle;
-                }
-                else // rotate an extra step until extraStepsCounter reaches mmToStep(endstopExtraDistance)
-                {
-                    enableStepper();
-                    moveOneStep(Direction::Backward);
-                }
             }
-            else 
+        }
+        else if(positionUnverified and goalStep == 0 and endstopSettled() and !isAtEndstop()) // checkpoint was off, find the endstop
+        {
+            positionUnverified = false;
+            rampStep = 0;
+            nextDelayQ = kTickQ; // homing starts on the next tick
+            startHoming();
+        }
+        else 
+        {
+            if(_state != MotionVisorState::Error) 
             {
-                if(_state != MotionVisorState::Error) 
-                {
-                    _state = MotionVisorState::Idle;
-                }
-                disableStepper();
+                _state = MotionVisorState::Idle;
             }
-            cnt = 0;
+            rampStep = 0;
+            nextDelayQ = queueHead != queueTail ? kHoldPollQ : 0; // park, unless a held segment is waiting
+            disableStepper();
+            checkIdleEndstop();
         }
     }
     else
     {
+        nextDelayQ = 0; // parked until autoHome()
         disableStepper();
+        checkIdleEndstop();
     }
 }
 
-MotionVisor::~MotionVisor()
+// Standing still, the endstop has to agree with the position: a vent pushed by hand or
+// steps lost on the way show up here. MotionVisor::loop() wakes a parked axis for it.
+void MotionVisor::checkIdleEndstop()
+{
+    if(_state != MotionVisorState::Idle)
+        return;
+    if(isAtEndstop())
+    {
+        if(!currentStep.has_value())
+            currentStep = 0; // closed state
+        else if(currentStep.value() > profile.extraDistanceSteps)
+        {
+            _state = MotionVisorState::Error; // it should be opened but endstop is sensing a closed state
+            currentStep = std::nullopt;
+        }
+    }
+    else if(currentStep.has_value() and currentStep.value() == 0)
+    {
+        _state = MotionVisorState::Error; // it should be closed but endstop ain't sensing a closed state
+        currentStep = std::nullopt;
+    }
+}
+
+void MotionVisor::publishSnapshot()
+{
+    Snapshot now;
+    now.state = _state;
+    now.homed = currentStep.has_value();
+    now.homing = autoHomeFlag;
+    now.atEndstop = isAtEndstop();
+    now.step = currentStep.value_or(0);
+    now.takenSequence = mailboxSequence;
+    snapshot.write(now);
+}
+
+// At the current goal: move on to the next queued segment. A segment without hold time is
+// taken at once (it was already blended in by lookAheadSteps), one with a hold time waits
+// until the vent stands still and the time has passed.
+void MotionVisor::takeNextSegment()
+{
+    if(queueHead == queueTail)
+        return;
+    const MotionSegment& next = queue[queueHead % kQueueDepth];
+    if(next.holdMs > 0)
+    {
+        if(rampStep > 0)
+            return;
+        if(!holdStarted)
+        {
+            holdStarted = true;
+            holdStartMs = millis();
+        }
+        if(millis() - holdStartMs < next.holdMs)
+            return;
+    }
+    holdStarted = false;
+    goalStep = next.goalStep;
+    queueHead = queueHead + 1;
+}
+
+// Distance the queue continues past goalStep in the same direction without a hold, so the
+// ramp only brakes for the last of those segments instead of stopping at each one
+long MotionVisor::lookAheadSteps(Direction travel)
+{
+    long last = goalStep;
+    for(uint8_t i = queueHead; i != queueTail; i++)
+    {
+        const MotionSegment& next = queue[i % kQueueDepth];
+        const bool onward = travel == Direction::Forward ? next.goalStep > last : next.goalStep < last;
+        if(next.holdMs > 0 or !onward)
+            break;
+        last = next.goalStep;
+    }
+    return std::abs(last - goalStep);
+}
+
+// Steps already taken toward home since the endstop really tripped: the debounced EXTI
+// endstop is noticed late, but the step of its first edge is known. Polled: noticed at once.
+long MotionVisor::stepsPastEndstop()
+{
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    return std::max(0L, endstopTripStep - stepCount);
+#else
+    return 0;
+#endif
+}
+
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+// EXTI on the endstop pin, both edges: only note the level and when it changed, a
+// bouncing contact restarts the debounce time but keeps the step of its first edge
+void MotionVisor::endstopEdge()
+{
+    const int level = digitalRead(endstopPin);
+    if(!endstopPending)
+        endstopEdgeStep = stepCount;
+    endstopPendingLevel = level;
+    endstopPending = level != endstopLevel;
+    endstopEdgeUs = micros();
+    wake(); // a parked axis still has to latch it
+}
+
+// runs at the top of every stepper interrupt, latches a level that held for the debounce time
+void MotionVisor::debounceEndstop()
+{
+    if(endstopPending and micros() - endstopEdgeUs >= profile.endstopDebounceUs)
+    {
+        endstopLevel = endstopPendingLevel;
+        endstopTripStep = endstopEdgeStep;
+        endstopPending = false;
+    }
+}
+#endif
+
+#ifdef MOTIONVISOR_HW_STEP
+void MotionVisor::scheduleStepPulse()
+{
+    // the pulse armed in this interrupt fires at the end of the delay the planner asked for
+    // after the previous step; a delay beyond kMaxPeriodUs runs as pulseless periods first,
+    // the last one, at least kMinPeriodUs, ends with the pulse
+    if(pulseArmed)
+    {
+        pulseWaitUs = std::max(pulseLeadQ >> 8, kMinPeriodUs);
+        pulseLeadQ = nextDelayQ;
+        pulseArmed = false;
+    }
+    else if(pulseWaitUs == 0)
+    {
+        pulseLeadQ = 0;
+    }
+    uint32_t periodUs = kIdlePeriodUs;
+    bool pulse = false;
+    if(pulseWaitUs > kMaxPeriodUs)
+    {
+        periodUs = std::min(kMaxPeriodUs, pulseWaitUs - kMinPeriodUs);
+        pulseWaitUs -= periodUs;
+    }
+    else if(pulseWaitUs > 0)
+    {
+        periodUs = pulseWaitUs;
+        pulseWaitUs = 0;
+        pulse = true;
+    }
+    TIM3->ARR = periodUs - 1;
+    TIM3->CCR1 = pulse ? periodUs - kPulseWidthUs : periodUs; // PWM2: high while CNT >= CCR1
+}
+#endif
+
+// Hands the interrupt the current commands: a whole new copy, so it never sees half of one
+void MotionVisor::post()
+{
+    mailbox.write(commands);
+    wake();
+}
+
+// the producers (post, queueVentingPercent) call this after handing the interrupt new
+// work, a parked axis isn't run otherwise
+void MotionVisor::wake()
 {
+    if(attached)
+        StepScheduler::instance().wake(this);
+}
 
+MotionVisor::~MotionVisor()
+{
+    if(attached)
+        StepScheduler::instance().detach(this);
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    detachInterrupt(digitalPinToInterrupt(endstopPin));
+#endif
 }
 
 void MotionVisor::loop()
 {
-    if(!autoHomeFlag)
+    // the endstop changed since the interrupt last looked, let it check the position
+    const Snapshot now = snapshot.read();
+    if(!now.homing and endstopActive(config.invertEndstopPin) != now.atEndstop)
+        wake();
+    if(scheduleCount > 0 and millis() - scheduleCheckMs >= kScheduleIntervalMs)
+    {
+        scheduleCheckMs = millis();
+        const int percent = schedulePercent();
+        if(percent != schedulePostedPercent and setGoalPercent(percent)) // a repeated goal would still flush the queue
+            schedulePostedPercent = percent;
+    }
+}
+
+// Trapezoidal profile in integer math (Austin's ramp approximation): each accelerating step
+// shortens the step delay by 2c/(4n+1), each decelerating step undoes it, and braking starts
+// once the remaining distance is within the number of steps taken to ramp up.
+uint32_t MotionVisor::computeDelayTicks(long stepsToGo)
+{
+    if(profile.rampStartDelayQ == 0) // no acceleration limit configured, run at cruise speed
+    {
+        rampStep = 1;
+        stepDelayQ = profile.cruiseDelayQ;
+    }
+    else if(rampStep == 0) // first step from standstill
+    {
+        rampStep = 1;
+        stepDelayQ = std::max(profile.rampStartDelayQ, profile.cruiseDelayQ);
+    }
+    else if(stepsToGo <= (long)rampStep or stepDelayQ < profile.cruiseDelayQ) // decelerate (also when speed was lowered mid-move)
     {
-        if(_state == MotionVisorState::Idle)// if not moving
+        const bool toCruise = stepsToGo > (long)rampStep;
+        if(rampStep > 1)
         {
-            if(isAtEndstop()) // check if the vent state
-            {
-                if(currentStep.has_value())
-                {
-                    if(currentStep.value() > mmToStep(config.endstopExtraDistance))
-                    {
-                        _state = MotionVisorState::Error; // it should be opened but endstop is sensing a closed state
-                        currentStep = std::nullopt;
-                    }
-                }
-                else
-                {
-                    currentStep = 0; // closed state
-                    _state = MotionVisorState::Idle;
-                }
-            }
-            else
-            {
-                if(currentStep.has_value())
-                {
-                    if(currentStep.value() == 0)
-                    {
-                        _state = MotionVisorState::Error; // it should be closed but endstop ain't sensing a closed state
-                        currentStep = std::nullopt;
-                    }
-                }
-            }
+            stepDelayQ += (2 * stepDelayQ) / (4 * rampStep - 5);
+            rampStep--;
         }
+        if(toCruise and stepDelayQ > profile.cruiseDelayQ)
+            stepDelayQ = profile.cruiseDelayQ;
+    }
+    else if(stepDelayQ > profile.cruiseDelayQ) // accelerate up to cruise speed
+    {
+        stepDelayQ -= (2 * stepDelayQ) / (4 * rampStep + 1);
+        rampStep++;
+        if(stepDelayQ < profile.cruiseDelayQ)
+            stepDelayQ = profile.cruiseDelayQ;
     }
+    return stepDelayQ;
 }
 
 unsigned long MotionVisor::mmToStep(double mm)
@@ -160,40 +490,158 @@ unsigned long MotionVisor::mmToStep(double mm)
 
 void MotionVisor::setVentingPercent(int percent)
 {
-    if(currentStep.has_value() and _state != MotionVisorState::Error) // if autoHomed
+    clearSchedule();
+    setGoalPercent(percent);
+}
+
+// false when not homed, nothing is posted then
+bool MotionVisor::setGoalPercent(int percent)
+{
+    const Snapshot now = snapshot.read();
+    if(now.homed and now.state != MotionVisorState::Error) // if autoHomed
     {
-        double lowerLimit = (((config.endstopExtraDistance * 2.0) / config.length) * 100.0); // Percent of (2 x endstopExtraDistance)
-        if(percent > 100) percent = 100; // upper limit
-        if(percent < lowerLimit) percent = 0; // lower limit
-        auto calculatedSteps = mmToStep(config.length * ((double)percent / 100.0));
-        if(goalStep != calculatedSteps) // if data is new
-        {
-            goalStep = calculatedSteps;
-            totalDistSteps = std::abs(currentStep.value() - goalStep);
-        }
+        flushQueue(); // a direct setpoint replaces any queued plan
+        commands.goalStep = percentToStep(percent);
+        commands.goalRevision++;
+        post();
+        return true;
+    }
+    return false;
+}
+
+// Appends a segment behind the queued ones; false when not homed or the queue is full
+bool MotionVisor::queueVentingPercent(int percent, uint32_t holdMs)
+{
+    const Snapshot now = snapshot.read();
+    if(!now.homed or now.state == MotionVisorState::Error or now.homing)
+        return false;
+    clearSchedule();
+    if(queuedSegments() >= kQueueDepth)
+        return false;
+    queue[queueTail % kQueueDepth] = MotionSegment{percentToStep(percent), holdMs};
+    queueTail = queueTail + 1; // publish after the segment is written
+    wake();
+    return true;
+}
+
+// The interrupt owns queueHead, so dropping the queue is only requested here: everything
+// queued so far goes on its next run, segments queued after this call are kept
+void MotionVisor::flushQueue()
+{
+    queueFlushTail = queueTail;
+    queueFlushRequest = queueFlushRequest + 1;
+}
+
+size_t MotionVisor::queuedSegments() const
+{
+    const uint8_t head = queueFlushDone != queueFlushRequest ? queueFlushTail : queueHead;
+    return (uint8_t)(queueTail - head);
+}
+
+// Points must be in increasing time order (within the period, if one is given).
+// nowS tells where in the schedule the device is right now, e.g. the time of day.
+bool MotionVisor::setSchedule(const SchedulePoint* points, size_t count, uint32_t periodS, uint32_t nowS)
+{
+    if(count == 0 or count > kMaxSchedulePoints)
+        return false;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(i > 0 and points[i].atS <= points[i - 1].atS)
+            return false;
+        if(periodS > 0 and points[i].atS >= periodS)
+            return false;
+    }
+    std::copy(points, points + count, schedule);
+    scheduleCount = count;
+    schedulePeriodS = periodS;
+    scheduleOffsetS = nowS;
+    schedulePostedPercent = -1;
+    scheduleStartMs = millis();
+    scheduleCheckMs = scheduleStartMs - kScheduleIntervalMs; // apply on the next loop
+    return true;
+}
+
+// Linear interpolation between the points around the current schedule time. Without a
+// period the first and last points hold before and after, with one it wraps around.
+// The whole seconds passed move into scheduleOffsetS, so millis() - scheduleStartMs stays
+// short of its 49.7 day wrap, which would shift a periodic schedule.
+int MotionVisor::schedulePercent()
+{
+    const uint32_t passedS = (millis() - scheduleStartMs) / 1000;
+    scheduleStartMs += passedS * 1000;
+    scheduleOffsetS += passedS;
+    if(schedulePeriodS > 0)
+        scheduleOffsetS %= schedulePeriodS;
+    const uint32_t now = scheduleOffsetS;
+    const SchedulePoint& first = schedule[0];
+    const SchedulePoint& last = schedule[scheduleCount - 1];
+    if(now >= first.atS and now < last.atS)
+    {
+        size_t i = 1;
+        while(schedule[i].atS <= now) i++;
+        const SchedulePoint& from = schedule[i - 1];
+        const SchedulePoint& to = schedule[i];
+        return from.percent + (int64_t)((int)to.percent - from.percent) * (now - from.atS) / (to.atS - from.atS);
     }
+    if(schedulePeriodS == 0 or scheduleCount == 1)
+        return now < first.atS ? first.percent : last.percent;
+    // between the last point and the first one of the next period
+    const uint32_t span = schedulePeriodS - last.atS + first.atS;
+    const uint32_t since = now >= last.atS ? now - last.atS : now + schedulePeriodS - last.atS;
+    return last.percent + (int64_t)((int)first.percent - last.percent) * since / span;
+}
+
+long MotionVisor::percentToStep(int percent)
+{
+    double lowerLimit = (((config.endstopExtraDistance * 2.0) / config.length) * 100.0); // Percent of (2 x endstopExtraDistance)
+    if(percent > 100) percent = 100; // upper limit
+    if(percent < lowerLimit) percent = 0; // lower limit
+    return mmToStep(config.length * ((double)percent / 100.0));
 }
 
 std::optional<int> MotionVisor::ventingPercent()
 {
-    if(currentStep.has_value())
+    const Snapshot now = snapshot.read();
+    if(now.homed)
     {
-        return ((double)currentStep.value() / mmToStep(config.length)) * 100;
+        return ((double)now.step / mmToStep(config.length)) * 100;
     }
     return std::nullopt;
 }
 
+std::optional<long> MotionVisor::position() const
+{
+    const Snapshot now = snapshot.read();
+    return now.homed ? std::optional<long>(now.step) : std::nullopt;
+}
+
+bool MotionVisor::commandsTaken() const
+{
+    return snapshot.read().takenSequence == mailbox.sequence();
+}
 
 void MotionVisor::autoHome()
+{
+    flushQueue();
+    commands.homeRevision++;
+    post();
+}
+
+// interrupt side of autoHome(), also started by a close that misses the endstop
+void MotionVisor::startHoming()
 {
     if(!autoHomeFlag)
     {
         if(!isAtEndstop())
         {
             autoHomeFlag = true;
+            queueHead = queueTail; // homing drops the queued plan
+            holdStarted = false;
+            homingPhase = HomingPhase::FastApproach;
+            rampStep = 0;
             currentStep = std::nullopt;
             _state = MotionVisorState::Closing;
-            goalStep = -mmToStep(config.length + config.maxCompensation);
+            goalStep = -profile.homingTravelSteps;
         }
         else // already is at origin
         {
@@ -204,14 +652,89 @@ void MotionVisor::autoHome()
     }
 }
 
+// Takes over a checkpointed position instead of homing, if the endstop agrees with it.
+// Checked here against the last snapshot and again when the interrupt takes it over.
+bool MotionVisor::restorePosition(long step)
+{
+    const Snapshot now = snapshot.read();
+    if(now.homing or now.homed)
+        return false;
+    if(endstopSettled() and !plausiblePosition(step, endstopActive(config.invertEndstopPin), mmToStep(config.endstopExtraDistance)))
+        return false; // while the endstop debounces, the interrupt checks it once the level settled
+    commands.restoreStep = step;
+    commands.restoreRevision++;
+    post();
+    return true;
+}
+
+void MotionVisor::takeRestore(long step)
+{
+    if(autoHomeFlag or currentStep.has_value())
+        return;
+    if(!plausiblePosition(step, isAtEndstop(), profile.extraDistanceSteps))
+        return;
+    currentStep = step;
+    goalStep = step;
+    rampStep = 0;
+    positionUnverified = true;
+    _state = MotionVisorState::Idle;
+}
+
+// The endstop is active from extraDistanceSteps down to 0, and the next close verifies it
+bool MotionVisor::plausiblePosition(long step, bool atEndstop, long extraDistanceSteps)
+{
+    return atEndstop ? step <= extraDistanceSteps : step > 0;
+}
+
 void MotionVisor::setConfig(const MotionVisorConfig &config)
 {
     this->config = config;
+    // derived values are precomputed here so stepperAsyncLoop only does integer math
+    Profile& derived = commands.profile;
+    const double vMax = config.speed * config.stepPermm; // steps/s
+    const double aSteps = config.acceleration * config.stepPermm; // steps/s2
+    derived.cruiseDelayQ = vMax > 0 ? (uint32_t)((kTickHz / vMax) * kTickQ) : UINT32_MAX;
+    derived.rampStartDelayQ = aSteps > 0 ? (uint32_t)(0.676 * kTickHz * std::sqrt(2.0 / aSteps) * kTickQ) : 0; // first ramp step (c0)
+    derived.extraDistanceSteps = mmToStep(config.endstopExtraDistance);
+    const double homingFast = config.homingSpeed * config.stepPermm; // steps/s
+    const double homingSlow = config.homingSlowSpeed * config.stepPermm;
+    derived.homingFastDelayQ = homingFast > 0 ? (uint32_t)((kTickHz / homingFast) * kTickQ) : derived.cruiseDelayQ;
+    derived.homingSlowDelayQ = homingSlow > 0 ? (uint32_t)((kTickHz / homingSlow) * kTickQ) : derived.homingFastDelayQ;
+    derived.homingBackoffSteps = mmToStep(config.homingBackoff);
+    derived.compensationSteps = mmToStep(config.maxCompensation);
+    derived.homingTravelSteps = mmToStep(config.length + config.maxCompensation);
+    derived.endstopDebounceUs = (uint32_t)(config.endstopDebounce * 1000);
+    derived.invertDir = config.invertDir;
+    derived.invertEndstopPin = config.invertEndstopPin;
+    commands.profileRevision++;
+    post(); // the interrupt switches over between two steps
 }
 
+// main loop side, with the endstop polarity as configured there
+bool MotionVisor::endstopActive(bool inverted)
+{
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    const int level = endstopLevel;
+#else
+    const int level = digitalRead(endstopPin);
+#endif
+    return inverted ? !level : level;
+}
+
+// interrupt side, with the polarity of the profile it took
 bool MotionVisor::isAtEndstop()
 {
-    return config.invertEndstopPin ? !digitalRead(endstopPin) : digitalRead(endstopPin);
+    return endstopActive(profile.invertEndstopPin);
+}
+
+// false while an EXTI edge burst waits out the debounce time and the latched level may be stale
+bool MotionVisor::endstopSettled()
+{
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    return !endstopPending;
+#else
+    return true;
+#endif
 }
 
 void MotionVisor::disableStepper()
@@ -226,10 +749,19 @@ void MotionVisor::enableStepper()
 
 void MotionVisor::moveOneStep(Direction direction)
 {
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    stepCount += direction == Direction::Forward ? 1 : -1;
+#endif
     if(direction == Direction::Forward)
-        digitalWrite(dirPin, config.invertDir ? HIGH : LOW);
+        digitalWrite(dirPin, profile.invertDir ? HIGH : LOW);
     else
-        digitalWrite(dirPin, config.invertDir ? LOW : HIGH);
+        digitalWrite(dirPin, profile.invertDir ? LOW : HIGH);
+#ifdef MOTIONVISOR_HW_STEP
+    pulseArmed = true; // TIM3 emits the pulse a full period after DIR was set
+#else
+    delayMicroseconds(kDirSetupUs); // A4988 DIR-to-STEP setup time
     digitalWrite(stepPin, HIGH); // rotate 1 step
+    delayMicroseconds(kPulseWidthUs); // A4988 minimum STEP high time
     digitalWrite(stepPin, LOW);
+#endif
 }
@@ -1,8 +1,9 @@
 #pragma once
 #include "MotionVisorState.hpp"
 #include "MotionVisorConfig.hpp"
-#include <arduino.h>
-#include <HardwareTimer.h>
+#include "StepScheduler.hpp"
+#include "SeqLock.hpp"
+#include <Arduino.h>
 
 class MotionVisor
 {
@@ -12,34 +13,197 @@ public:
         Forward,
         Backward
     };
+    enum class HomingPhase
+    {
+        FastApproach,
+        BackOff,
+        SlowApproach
+    };
+    struct Pins
+    {
+        int dir = PC14;
+#ifdef MOTIONVISOR_HW_STEP
+        int step = PA6; // must be TIM3 CH1
+#else
+        int step = PC15;
+#endif
+        int en = PB0;
+        int endstop = PB1;
+    };
+    struct SchedulePoint
+    {
+        uint32_t atS; // seconds into the schedule (or into the period)
+        uint8_t percent;
+    };
     MotionVisor();
     ~MotionVisor();
 
+    bool begin(const Pins& pins); // claims the pins and a StepScheduler slot
+    bool begin() { return begin(Pins()); }
+
     void setConfig(const MotionVisorConfig &config);
     MotionVisorConfig getConfig() {return config;}
-    void setVentingPercent(int percent);
+    void setVentingPercent(int percent); // immediate, drops queued segments and stops the schedule
+    bool queueVentingPercent(int percent, uint32_t holdMs = 0); // stops the schedule
+    size_t queuedSegments() const;
+    bool setSchedule(const SchedulePoint* points, size_t count, uint32_t periodS, uint32_t nowS);
+    void clearSchedule() { scheduleCount = 0; }
+    bool scheduleActive() const { return scheduleCount > 0; }
     std::optional<int> ventingPercent();
     void autoHome();
+    bool restorePosition(long step);
+    std::optional<long> position() const;
+    bool commandsTaken() const; // the interrupt has caught up with everything posted so far
     void loop();
-    MotionVisorState state() const { return _state; }
+    MotionVisorState state() const { return snapshot.read().state; }
 
+    static constexpr size_t kQueueDepth = 8; // power of two, indexes wrap with uint8_t
+    static constexpr size_t kMaxSchedulePoints = 16;
 
 private:
-    void stepperAsyncLoop();
+    friend class StepScheduler;
+    struct MotionSegment
+    {
+        long goalStep;
+        uint32_t holdMs; // wait after arriving at the previous goal, 0 = blend into it
+    };
+    // config as the interrupt needs it, precomputed by setConfig so it only does integer math
+    struct Profile
+    {
+        uint32_t cruiseDelayQ = 0; // Q8 ticks per step at cruise speed
+        uint32_t rampStartDelayQ = 0; // Q8 ticks for the first step from standstill (0 = no ramp)
+        uint32_t homingFastDelayQ = 0;
+        uint32_t homingSlowDelayQ = 0;
+        long extraDistanceSteps = 0;
+        long homingBackoffSteps = 0;
+        long compensationSteps = 0; // maxCompensation
+        long homingTravelSteps = 0; // length + maxCompensation, limit of the fast approach
+        uint32_t endstopDebounceUs = 0;
+        bool invertDir = false;
+        bool invertEndstopPin = false;
+    };
+    // main loop -> interrupt: the latest request of each kind, a changed revision is a new one
+    struct Commands
+    {
+        uint32_t goalRevision = 0;
+        long goalStep = 0;
+        uint32_t homeRevision = 0;
+        uint32_t restoreRevision = 0;
+        long restoreStep = 0;
+        uint32_t profileRevision = 0;
+        Profile profile;
+    };
+    // interrupt -> main loop, published at the end of every run
+    struct Snapshot
+    {
+        MotionVisorState state = MotionVisorState::Uninitialized;
+        bool homed = false;
+        bool homing = false;
+        bool atEndstop = false;
+        long step = 0;
+        uint32_t takenSequence = 0; // mailbox sequence the run worked with
+    };
+
+    uint32_t stepperAsyncLoop(); // returns the Q8 delay until it wants to run again
+    void planStep();
+    bool takeCommands();
+    void startHoming();
+    void takeRestore(long step);
+    void checkIdleEndstop();
+    void publishSnapshot();
+    void post();
+    void wake();
+    void flushQueue();
+    void takeNextSegment();
+    long lookAheadSteps(Direction travel);
+    long percentToStep(int percent);
+    bool setGoalPercent(int percent);
+    int schedulePercent();
+    uint32_t computeDelayTicks(long stepsToGo);
+    long stepsPastEndstop();
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    void endstopEdge();
+    void debounceEndstop();
+#endif
+#ifdef MOTIONVISOR_HW_STEP
+    void scheduleStepPulse();
+#endif
     unsigned long mmToStep(double mm);
+    static bool plausiblePosition(long step, bool atEndstop, long extraDistanceSteps);
+    bool endstopActive(bool inverted);
     bool isAtEndstop();
+    bool endstopSettled();
     void disableStepper();
     void enableStepper();
     void moveOneStep(Direction direction);
 
-    HardwareTimer timer;
-    MotionVisorState _state = MotionVisorState::Uninitialized;
     int dirPin = PC14, stepPin = PC15, enPin = PB0, endstopPin = PB1;
+    bool attached = false;
+    // main loop side: config and the commands posted to the interrupt, never torn by it
     MotionVisorConfig config;
+    Commands commands;
+    SeqLock<Commands> mailbox;
+    SeqLock<Snapshot> snapshot;
+    // interrupt side, written by stepperAsyncLoop only (as is the planner state below)
+    uint32_t mailboxSequence = 0; // last mailbox sequence taken
+    Commands taken; // revisions already acted on
+    Profile profile;
+    MotionVisorState _state = MotionVisorState::Uninitialized;
     long goalStep = 0;
-    long totalDistSteps = 0;
     std::optional<long> currentStep = std::nullopt;
-    double vMax = 0;
-    double aSteps = 0;
+    static constexpr uint32_t kPulseWidthUs = 2; // STEP high time (A4988 needs >= 1us)
+#ifdef MOTIONVISOR_HW_STEP
+    static constexpr double kTickHz = 1000000.0; // TIM3 counter rate, delays are in 1us ticks
+    static constexpr uint32_t kStepChannel = 1;
+    static constexpr uint32_t kIdlePeriodUs = 1000; // interrupt rate while no pulse is due
+    static constexpr uint32_t kMinPeriodUs = 20; // leaves room for the interrupt before the next update
+    static constexpr uint32_t kMaxPeriodUs = 0xFFFF; // 16-bit ARR at the 1us count
+    uint32_t pulseLeadQ = 0; // period preceding the next armed pulse
+    uint32_t pulseWaitUs = 0; // what is left of the pending pulse's delay, waited out in pulseless periods
+    bool pulseArmed = false;
+#else
+    static constexpr double kTickHz = 1000000.0 / StepScheduler::kTickUs; // StepScheduler tick rate
+    static constexpr uint32_t kDirSetupUs = 1; // DIR-to-STEP setup time (A4988 needs >= 200ns)
+#endif
+    static constexpr uint32_t kTickQ = StepScheduler::kTickQ;
+    static constexpr uint32_t kHoldPollQ = (uint32_t)(kTickHz / 100) * kTickQ; // 10ms, rechecks a held segment
+    // planner state
+    uint32_t stepDelayQ = 0; // Q8 ticks per step at the current speed
+    uint32_t rampStep = 0; // steps taken along the ramp (0 = standing still)
+    uint32_t nextDelayQ = 0; // Q8 ticks until the next step, 0 = nothing to do (parked)
+    Direction motionDirection = Direction::Forward;
+    // segment ring: setVentingPercent/queueVentingPercent produce, stepperAsyncLoop consumes
+    MotionSegment queue[kQueueDepth];
+    volatile uint8_t queueHead = 0; // written by the interrupt only
+    volatile uint8_t queueTail = 0; // written by the main loop only
+    volatile uint8_t queueFlushTail = 0; // drop segments up to here ...
+    volatile uint8_t queueFlushRequest = 0; // ... when this differs from queueFlushDone
+    uint8_t queueFlushDone = 0;
+    bool holdStarted = false;
+    unsigned long holdStartMs = 0;
+    // piecewise-linear schedule, followed by loop()
+    static constexpr unsigned long kScheduleIntervalMs = 1000;
+    SchedulePoint schedule[kMaxSchedulePoints];
+    size_t scheduleCount = 0; // 0 = no schedule
+    uint32_t schedulePeriodS = 0; // repeat length, 0 = hold the last point
+    uint32_t scheduleOffsetS = 0; // schedule time at scheduleStartMs, both advanced on every check
+    unsigned long scheduleStartMs = 0;
+    unsigned long scheduleCheckMs = 0;
+    int schedulePostedPercent = -1; // last goal the schedule posted, -1 = none yet
     bool autoHomeFlag = false;
+    HomingPhase homingPhase = HomingPhase::FastApproach;
+    long homingExtraSteps = 0; // taken past the endstop while homing
+    long closingExtraSteps = 0; // taken past the endstop on a full close
+    long homingSteps = 0; // steps taken in the current homing phase
+    bool positionUnverified = false; // restored from a checkpoint, not yet confirmed by the endstop
+#ifdef MOTIONVISOR_EXTI_ENDSTOP
+    // endstop level as seen by the planner, latched by debounceEndstop() from EXTI edges
+    long stepCount = 0; // raw step counter (+1 forward, -1 backward), never reset
+    volatile int endstopLevel = LOW;
+    volatile int endstopPendingLevel = LOW;
+    volatile bool endstopPending = false;
+    volatile uint32_t endstopEdgeUs = 0; // last edge of the current burst
+    volatile long endstopEdgeStep = 0; // stepCount at the first edge of the current burst
+    long endstopTripStep = 0; // stepCount where the latched level changed
+#endif
 };
\ No newline at end of file
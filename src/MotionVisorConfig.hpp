@@ -12,4 +12,8 @@ struct MotionVisorConfig
     double length = 30; // mm (vent length)
     double maxCompensation = 5; // mm (affects only closing)
     double acceleration = 20; // mm/s2
+    double homingSpeed = 8; // mm/s, approach until the endstop trips
+    double homingSlowSpeed = 1; // mm/s, second approach after backing off
+    double homingBackoff = 2; // mm to back off past the endstop release (0 = single fast approach)
+    double endstopDebounce = 2; // ms the endstop level must hold before it counts (MOTIONVISOR_EXTI_ENDSTOP only)
 };
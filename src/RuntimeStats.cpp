@@ -0,0 +1,63 @@
+#include "RuntimeStats.hpp"
+
+#ifdef VENTDRIVE_STATS
+uint32_t RuntimeStats::cyclesPerUs_ = 72;
+uint32_t RuntimeStats::loopStartCycles_ = 0;
+uint32_t RuntimeStats::loopStartUs_ = 0;
+bool RuntimeStats::loopStarted_ = false;
+RuntimeStats::TimingStat RuntimeStats::timings_[(size_t)Timing::Count];
+uint32_t RuntimeStats::counters_[(size_t)Counter::Count] = {};
+uint32_t RuntimeStats::timeouts_[kBusStates] = {};
+
+void RuntimeStats::begin()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    cyclesPerUs_ = SystemCoreClock / 1000000;
+}
+
+// Runs in the step interrupt too: a handful of compares, no division
+void RuntimeStats::record(Timing timing, uint32_t cycles)
+{
+    TimingStat& stat = timings_[(size_t)timing];
+    stat.count++;
+    stat.totalCycles += cycles;
+    if(cycles < stat.minCycles) stat.minCycles = cycles;
+    if(cycles > stat.maxCycles) stat.maxCycles = cycles;
+    size_t bucket = 0;
+    while(bucket < kBuckets - 1 and cycles >= (cyclesPerUs_ << (2 * bucket)))
+        bucket++;
+    stat.histogram[bucket]++;
+}
+
+// CYCCNT stops while the core sleeps in WFI, and keeping it running through sleep (DBGMCU
+// DBG_SLEEP) would cost the sleep savings. The loop period, which spans the sleep, is taken
+// from micros() instead, whose SysTick keeps counting, and recorded in cycles like the rest.
+void RuntimeStats::beginLoop()
+{
+    const uint32_t now = micros();
+    if(loopStarted_)
+        record(Timing::Loop, (now - loopStartUs_) * cyclesPerUs_);
+    loopStartUs_ = now;
+    loopStarted_ = true;
+    loopStartCycles_ = cycles();
+}
+
+void RuntimeStats::endLoop()
+{
+    record(Timing::Work, cycles() - loopStartCycles_);
+}
+
+void RuntimeStats::reset()
+{
+    noInterrupts();
+    for(TimingStat& stat : timings_)
+        stat = TimingStat();
+    for(uint32_t& counter : counters_)
+        counter = 0;
+    for(uint32_t& timeout : timeouts_)
+        timeout = 0;
+    interrupts();
+}
+#endif
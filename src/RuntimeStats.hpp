@@ -0,0 +1,150 @@
+#pragma once
+#include <Arduino.h>
+#include "FixedBuffer.hpp"
+#include "VentStatus.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Cycle-accurate timing of the hot paths (DWT CYCCNT) and runtime error counters, read
+// over FusionBus with {"id":..,"stats":"step"|"loop"|"work"|"json"|"counters"|"reset"}.
+// Enabled by VENTDRIVE_STATS; without it every hook is an empty inline function and
+// nothing is kept in RAM.
+class RuntimeStats
+{
+public:
+    enum class Timing : uint8_t
+    {
+        Step,       // one MotionVisor::stepperAsyncLoop call
+        Loop,       // main-loop period: from one SystemFacade::loop pass to the next, WFI sleep included
+        Work,       // one SystemFacade::loop pass up to its WFI sleep
+        Json,       // deserializeJson of a Communicate frame
+        Count
+    };
+    enum class Counter : uint8_t
+    {
+        FramesSeen,      // Communicate and binary frames on the bus
+        FramesAddressed, // ... handed to this device
+        UartOverrun,
+        UartFraming,
+        UartNoise,
+        UartParity,
+        MissedStep,      // the step interrupt overran the next timer period
+        Count
+    };
+    static constexpr size_t kBusStates = 8; // covers FusionBusSlave::State
+    static constexpr size_t kBuckets = 8; // bucket i counts samples below 4^i us, the last one the rest
+
+    struct TimingStat
+    {
+        uint32_t count = 0;
+        uint32_t minCycles = UINT32_MAX;
+        uint32_t maxCycles = 0;
+        uint64_t totalCycles = 0;
+        uint32_t histogram[kBuckets] = {};
+    };
+
+#ifdef VENTDRIVE_STATS
+    static void begin(); // starts the DWT cycle counter
+    static uint32_t cycles() { return DWT->CYCCNT; }
+    static void record(Timing timing, uint32_t cycles);
+    static void count(Counter counter) { counters_[(size_t)counter]++; }
+    static void countTimeout(size_t busState) { if(busState < kBusStates) timeouts_[busState]++; }
+    static void beginLoop();
+    static void endLoop();
+    static void reset();
+
+    // Reply to a stats query, false for an unknown name
+    template<size_t Capacity>
+    static bool write(FixedBuffer<Capacity>& out, std::string_view name);
+#else
+    static void begin() {}
+    static uint32_t cycles() { return 0; }
+    static void record(Timing, uint32_t) {}
+    static void count(Counter) {}
+    static void countTimeout(size_t) {}
+    static void beginLoop() {}
+    static void endLoop() {}
+#endif
+
+    // times the enclosing scope
+    class Scope
+    {
+    public:
+#ifdef VENTDRIVE_STATS
+        explicit Scope(Timing timing): timing_(timing), start_(cycles()) {}
+        ~Scope() { record(timing_, cycles() - start_); }
+    private:
+        Timing timing_;
+        uint32_t start_;
+#else
+        explicit Scope(Timing) {}
+#endif
+    };
+
+#ifdef VENTDRIVE_STATS
+private:
+    template<size_t Capacity>
+    static bool appendList(FixedBuffer<Capacity>& out, const uint32_t* values, size_t count);
+
+    static constexpr std::string_view kTimingNames[] = {"step", "loop", "work", "json"};
+    static uint32_t cyclesPerUs_;
+    static uint32_t loopStartCycles_;
+    static uint32_t loopStartUs_;
+    static bool loopStarted_;
+    static TimingStat timings_[(size_t)Timing::Count];
+    static uint32_t counters_[(size_t)Counter::Count];
+    static uint32_t timeouts_[kBusStates];
+#endif
+};
+
+#ifdef VENTDRIVE_STATS
+template<size_t Capacity>
+bool RuntimeStats::appendList(FixedBuffer<Capacity>& out, const uint32_t* values, size_t count)
+{
+    bool ok = out.append("[");
+    for(size_t i = 0; i < count; i++)
+        ok = ok and (i == 0 or out.append(",")) and VentStatus::appendUnsigned(out, values[i]);
+    return ok and out.append("]");
+}
+
+// {"stats":"step","n":..,"min":..,"avg":..,"max":..,"hist":[..]}, times in cycles
+// {"stats":"counters","seen":..,"addressed":..,"timeouts":[..],"uart":[ore,fe,ne,pe],"missedSteps":..},
+// timeouts indexed by FusionBusSlave::State (Idle restarting its matcher is routine, not counted)
+template<size_t Capacity>
+bool RuntimeStats::write(FixedBuffer<Capacity>& out, std::string_view name)
+{
+    out.clear();
+    if(name == "reset")
+    {
+        reset();
+        return out.append("{\"stats\":\"reset\"}");
+    }
+    if(name == "counters")
+    {
+        const uint32_t* uart = &counters_[(size_t)Counter::UartOverrun];
+        return out.append("{\"stats\":\"counters\",\"seen\":") and VentStatus::appendUnsigned(out, counters_[(size_t)Counter::FramesSeen]) and
+               out.append(",\"addressed\":") and VentStatus::appendUnsigned(out, counters_[(size_t)Counter::FramesAddressed]) and
+               out.append(",\"timeouts\":") and appendList(out, timeouts_, kBusStates) and
+               out.append(",\"uart\":") and appendList(out, uart, 4) and
+               out.append(",\"missedSteps\":") and VentStatus::appendUnsigned(out, counters_[(size_t)Counter::MissedStep]) and
+               out.append("}");
+    }
+    for(size_t i = 0; i < (size_t)Timing::Count; i++)
+    {
+        if(name != kTimingNames[i])
+            continue;
+        noInterrupts(); // the step interrupt records too
+        const TimingStat stat = timings_[i];
+        interrupts();
+        return out.append("{\"stats\":\"") and out.append(name) and
+               out.append("\",\"n\":") and VentStatus::appendUnsigned(out, stat.count) and
+               out.append(",\"min\":") and VentStatus::appendUnsigned(out, stat.count ? stat.minCycles : 0) and
+               out.append(",\"avg\":") and VentStatus::appendUnsigned(out, stat.count ? (uint32_t)(stat.totalCycles / stat.count) : 0) and
+               out.append(",\"max\":") and VentStatus::appendUnsigned(out, stat.maxCycles) and
+               out.append(",\"hist\":") and appendList(out, stat.histogram, kBuckets) and
+               out.append("}");
+    }
+    return false;
+}
+#endif
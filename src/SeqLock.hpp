@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Single-writer sequence lock for one core, where writer and reader never run in parallel,
+// one only ever interrupts the other. The writer never waits: it makes the sequence odd,
+// copies the value and makes it even again. A reader that catches an odd or changed
+// sequence has seen a torn copy: read() retries it (the main loop reading what an
+// interrupt wrote, which finished before read() resumed), tryRead() reports it (an
+// interrupt can't wait for the main loop it preempted, it tries again on its next run).
+template<typename T>
+class SeqLock
+{
+public:
+    void write(const T& value)
+    {
+        const uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        value_ = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        sequence_.store(sequence + 2, std::memory_order_relaxed);
+    }
+
+    bool tryRead(T& out) const
+    {
+        const uint32_t before = sequence_.load(std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        out = value_;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        return (before & 1) == 0 and before == sequence_.load(std::memory_order_relaxed);
+    }
+
+    T read() const
+    {
+        T out;
+        while(!tryRead(out)) {}
+        return out;
+    }
+
+    uint32_t sequence() const { return sequence_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> sequence_{0};
+    T value_{};
+};
@@ -0,0 +1,192 @@
+#include "StepScheduler.hpp"
+#include "MotionVisor.hpp"
+#include "RuntimeStats.hpp"
+#include <algorithm>
+#include <functional>
+
+StepScheduler& StepScheduler::instance()
+{
+    static StepScheduler scheduler;
+    return scheduler;
+}
+
+StepScheduler::StepScheduler(): timer_(TIM3)
+{
+#ifndef MOTIONVISOR_HW_STEP
+    // in hardware mode the axis programs TIM3 itself
+    timer_.setPrescaleFactor(timer_.getTimerClkFreq() / 1000000 * kCountUs);
+    setPeriodTicks(periodTicks_);
+    TIM3->CR1 &= ~TIM_CR1_ARPE; // a period written in the interrupt applies to the one just started
+    timer_.refresh();
+#endif
+    timer_.attachInterrupt(std::bind(&StepScheduler::tick, this));
+}
+
+bool StepScheduler::attach(MotionVisor* axis)
+{
+    if(axisCount_ >= kMaxAxes)
+        return false;
+    noInterrupts();
+    axes_[axisCount_] = axis;
+    elapsedQ_[axisCount_] = 0;
+    delayQ_[axisCount_] = 0;
+    wakeRequest_[axisCount_] = false;
+    axisCount_++;
+    interrupts();
+    wake(axis);
+    return true;
+}
+
+void StepScheduler::detach(MotionVisor* axis)
+{
+    noInterrupts();
+    for(size_t i = 0; i < axisCount_; i++)
+    {
+        if(axes_[i] != axis)
+            continue;
+        axisCount_--;
+        axes_[i] = axes_[axisCount_];
+        elapsedQ_[i] = elapsedQ_[axisCount_];
+        delayQ_[i] = delayQ_[axisCount_];
+        woken_[i] = woken_[axisCount_];
+        wakeRequest_[i] = wakeRequest_[axisCount_];
+        break;
+    }
+    if(axisCount_ == 0)
+        stop();
+    interrupts();
+}
+
+// The axis arrays belong to the interrupt, so the caller only leaves a request for it. The
+// timer is started when stopped: running_ goes up before the timer runs, a wake from the
+// EXTI interrupt in between sees it and leaves it alone, and the timer interrupt, which
+// can't fire before resume(), re-checks the requests after it stops.
+void StepScheduler::wake(MotionVisor* axis)
+{
+    for(size_t i = 0; i < axisCount_; i++)
+        if(axes_[i] == axis)
+            wakeRequest_[i] = true;
+    if(!running_)
+        start();
+}
+
+void StepScheduler::start()
+{
+    running_ = true;
+#ifndef MOTIONVISOR_HW_STEP
+    setPeriodTicks(1);
+#endif
+    timer_.setCount(0);
+    timer_.resume();
+}
+
+// A parked axis that was woken is due at the end of the running period
+void StepScheduler::takeWakeRequest(size_t i)
+{
+    if(!wakeRequest_[i])
+        return;
+    wakeRequest_[i] = false;
+    if(delayQ_[i] == 0)
+    {
+        delayQ_[i] = kTickQ;
+        elapsedQ_[i] = 0;
+        woken_[i] = true;
+    }
+}
+
+void StepScheduler::stop()
+{
+    timer_.pause();
+    running_ = false;
+}
+
+// Software mode: a period of n ticks adds n ticks of Q8 time to every running axis, keeping
+// the fractional tick so the average step rate stays exact; the next period ends at the
+// first tick where some axis is due, so steps land on the same ticks as with a fixed 100us
+// interrupt (a woken axis counts its first delay from the period it was woken in).
+// Hardware mode: every interrupt is a step slot, the timer period itself provides the
+// delay (see MotionVisor::scheduleStepPulse).
+void StepScheduler::tick()
+{
+#ifdef MOTIONVISOR_HW_STEP
+    if(axisCount_ > 0)
+        takeWakeRequest(0); // runs on every interrupt anyway
+    if(axisCount_ == 0 or runAxis(0) == 0)
+    {
+        stop(); // nothing armed, the last pulse went out with this update
+        if(axisCount_ > 0 and wakeRequest_[0])
+            start(); // woken while stopping
+    }
+#else
+    const uint32_t passedQ = periodTicks_ * kTickQ;
+    uint32_t nextTicks = kMaxPeriodTicks;
+    bool active = false;
+    for(size_t i = 0; i < axisCount_; i++)
+    {
+        takeWakeRequest(i);
+        if(delayQ_[i] == 0)
+            continue;
+        elapsedQ_[i] += passedQ;
+        if(elapsedQ_[i] >= delayQ_[i])
+        {
+            elapsedQ_[i] = woken_[i] ? 0 : elapsedQ_[i] - delayQ_[i];
+            woken_[i] = false;
+            delayQ_[i] = runAxis(i);
+            if(delayQ_[i] == 0)
+            {
+                elapsedQ_[i] = 0;
+                continue;
+            }
+        }
+        active = true;
+        const uint32_t remainingQ = delayQ_[i] > elapsedQ_[i] ? delayQ_[i] - elapsedQ_[i] : 0;
+        nextTicks = std::min(nextTicks, std::max<uint32_t>(1, (remainingQ + kTickQ - 1) / kTickQ));
+    }
+    if(!active)
+    {
+        stop();
+        bool woken = false; // scanned after stop(): a wake() before it saw running_ and only left its request
+        for(size_t i = 0; i < axisCount_; i++)
+            woken = woken or wakeRequest_[i];
+        if(woken)
+            start(); // woken from another interrupt during this one
+    }
+    else if(nextTicks != periodTicks_)
+    {
+        setPeriodTicks(nextTicks);
+    }
+#endif
+    // The counter passed the new period end while this interrupt ran; ARR applies at once,
+    // so it would count on through 0xFFFF before the next update. End the period with the
+    // next count instead.
+    const uint32_t count = TIM3->CNT;
+    const uint32_t reload = TIM3->ARR;
+    if(running_ and count > reload)
+    {
+        RuntimeStats::count(RuntimeStats::Counter::MissedStep);
+#ifdef MOTIONVISOR_HW_STEP
+        const uint32_t compare = TIM3->CCR1;
+        timer_.setCount(std::min(compare, reload)); // an armed pulse keeps its width
+#else
+        const uint32_t lateQ = (count - reload) * kTickQ / kCountsPerTick; // the next period only counts periodTicks_
+        timer_.setCount(reload);
+        for(size_t i = 0; i < axisCount_; i++)
+        {
+            if(delayQ_[i] != 0)
+                elapsedQ_[i] += lateQ;
+        }
+#endif
+    }
+}
+
+void StepScheduler::setPeriodTicks(uint32_t ticks)
+{
+    periodTicks_ = ticks;
+    timer_.setOverflow(periodTicks_ * kCountsPerTick, TICK_FORMAT); // ARR = counts - 1
+}
+
+uint32_t StepScheduler::runAxis(size_t i)
+{
+    RuntimeStats::Scope timing(RuntimeStats::Timing::Step);
+    return axes_[i]->stepperAsyncLoop();
+}
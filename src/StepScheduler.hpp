@@ -0,0 +1,56 @@
+#pragma once
+#include <Arduino.h>
+#include <HardwareTimer.h>
+#include <cstddef>
+#include <cstdint>
+
+class MotionVisor;
+
+// One TIM3 interrupt for every MotionVisor on the board. The per-interrupt loop is laid out
+// as struct-of-arrays: it only walks the packed Q8 timing arrays, and an axis' planner
+// (MotionVisor::stepperAsyncLoop) runs only when that axis has a step due.
+// Tickless: each timer period runs up to the earliest step deadline, an axis with nothing
+// to do parks until wake(), and the timer stops while every axis is parked. wake() only
+// raises a flag the interrupt consumes, it never masks interrupts.
+class StepScheduler
+{
+public:
+#ifdef MOTIONVISOR_HW_STEP
+    static constexpr size_t kMaxAxes = 1; // the TIM3 period is the step delay of the only axis
+#else
+    static constexpr size_t kMaxAxes = 4;
+#endif
+    static constexpr uint32_t kTickUs = 100; // step timing resolution in software stepping
+    static constexpr uint32_t kCountUs = 10; // timer count: a one-tick period still has ARR > 0, ARR 0 blocks the counter
+    static constexpr uint32_t kCountsPerTick = kTickUs / kCountUs;
+    static constexpr uint32_t kTickQ = 256; // one tick in Q8 fixed point
+    static constexpr uint32_t kMaxPeriodTicks = 100; // bounds how late a woken axis joins a running timer
+
+    static StepScheduler& instance();
+
+    bool attach(MotionVisor* axis); // the axis runs once right away, then as it asks
+    void detach(MotionVisor* axis);
+    void wake(MotionVisor* axis); // new work for a parked axis, also safe from an interrupt
+    size_t axisCount() const { return axisCount_; }
+    bool running() const { return running_; }
+    HardwareTimer& timer() { return timer_; }
+
+private:
+    StepScheduler();
+    void tick();
+    uint32_t runAxis(size_t i);
+    void start();
+    void stop();
+    void setPeriodTicks(uint32_t ticks);
+    void takeWakeRequest(size_t i);
+
+    HardwareTimer timer_;
+    volatile bool running_ = false;
+    uint32_t periodTicks_ = 1; // length of the running timer period
+    size_t axisCount_ = 0;
+    MotionVisor* axes_[kMaxAxes] = {};
+    uint32_t elapsedQ_[kMaxAxes] = {}; // Q8 ticks since the axis' last step
+    uint32_t delayQ_[kMaxAxes] = {}; // Q8 ticks until its next step, 0 = parked
+    bool woken_[kMaxAxes] = {}; // woken mid-period, the time before doesn't count
+    volatile bool wakeRequest_[kMaxAxes] = {}; // set by wake(), taken by the interrupt
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include "MotionVisorConfig.hpp"
+#include <cstdint>
+
+// MotionVisorConfig plus the bus assignments as they are journaled to flash: fixed layout
+// without padding, so a byte compare tells whether anything changed.
+// Bump kVersion whenever the layout changes, older records are then ignored.
+struct __attribute__((packed)) StoredConfig
+{
+    static constexpr uint16_t kVersion = 3;
+    static constexpr uint8_t kInvertDir = 0x01;
+    static constexpr uint8_t kInvertEndstopPin = 0x02;
+    static constexpr uint8_t kEndstopAtClosedState = 0x04;
+
+    uint8_t flags;
+    double endstopExtraDistance;
+    double stepPermm;
+    double speed;
+    double length;
+    double maxCompensation;
+    double acceleration;
+    double homingSpeed;
+    double homingSlowSpeed;
+    double homingBackoff;
+    double endstopDebounce;
+    uint32_t groupId;
+    int16_t slot;
+
+    static StoredConfig from(const MotionVisorConfig& config, uint32_t groupId, int slot)
+    {
+        StoredConfig stored;
+        stored.flags = (config.invertDir ? kInvertDir : 0) | 
+                       (config.invertEndstopPin ? kInvertEndstopPin : 0) | 
+                       (config.isEndstopAtClosedState ? kEndstopAtClosedState : 0);
+        stored.endstopExtraDistance = config.endstopExtraDistance;
+        stored.stepPermm = config.stepPermm;
+        stored.speed = config.speed;
+        stored.length = config.length;
+        stored.maxCompensation = config.maxCompensation;
+        stored.acceleration = config.acceleration;
+        stored.homingSpeed = config.homingSpeed;
+        stored.homingSlowSpeed = config.homingSlowSpeed;
+        stored.homingBackoff = config.homingBackoff;
+        stored.endstopDebounce = config.endstopDebounce;
+        stored.groupId = groupId;
+        stored.slot = (int16_t)slot;
+        return stored;
+    }
+
+    MotionVisorConfig toConfig() const
+    {
+        MotionVisorConfig config;
+        config.invertDir = flags & kInvertDir;
+        config.invertEndstopPin = flags & kInvertEndstopPin;
+        config.isEndstopAtClosedState = flags & kEndstopAtClosedState;
+        config.endstopExtraDistance = endstopExtraDistance;
+        config.stepPermm = stepPermm;
+        config.speed = speed;
+        config.length = length;
+        config.maxCompensation = maxCompensation;
+        config.acceleration = acceleration;
+        config.homingSpeed = homingSpeed;
+        config.homingSlowSpeed = homingSlowSpeed;
+        config.homingBackoff = homingBackoff;
+        config.endstopDebounce = endstopDebounce;
+        return config;
+    }
+};
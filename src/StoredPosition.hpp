@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+
+// Position checkpoint as journaled to flash: written once every vent is at rest and voided
+// by a journal mark as soon as its vent moves, so only a position taken at standstill is
+// ever restored.
+struct __attribute__((packed)) StoredPosition
+{
+    static constexpr uint16_t kVersion = 2; // 2: slots carry the per-axis marks
+
+    uint8_t valid;
+    int32_t step;
+};
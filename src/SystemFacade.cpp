@@ -1,16 +1,34 @@
 #include "SystemFacade.hpp"
 #include "ArduinoJson.h"
+#include "FusionBusBinary.hpp"
+#include "VentStatus.hpp"
+#include "RuntimeStats.hpp"
+#include <algorithm>
+#include <iterator>
 
 #define PAIR_BTN PB12
 #define COM_LED PB3
 #define LOOP_LED PC13
 
+// driver wiring per axis, the first entry is the single-vent board layout; the endstops
+// differ in pin number (PB1, PA0, PA8, PB9), MOTIONVISOR_EXTI_ENDSTOP needs an EXTI line each
+static const MotionVisor::Pins kAxisPins[] = {
+    MotionVisor::Pins(),
+    {PB13, PB14, PB15, PA0}, // dir, step, en, endstop
+    {PA4, PA5, PA7, PA8},
+    {PB5, PB6, PB7, PB9},
+};
+static_assert(SystemFacade::kAxisCount <= sizeof(kAxisPins) / sizeof(kAxisPins[0]), "no pins for every axis");
+
 SystemFacade::SystemFacade(uint32_t id):
-    id(id), 
     fusionBus("Ventdrive"), 
-    motionVisor(), 
+    configJournal(FLASH_BASE + kConfigJournalOffset),
+    positionJournal(FLASH_BASE + kPositionJournalOffset),
     loopLedMillis(0)
-{}
+{
+    for(size_t i = 0; i < kAxisCount; i++)
+        axes[i].id = id + i;
+}
 
 void SystemFacade::begin()
 {
@@ -29,17 +47,117 @@ void SystemFacade::begin()
     pinMode(LOOP_LED, OUTPUT);
     pinMode(COM_LED, OUTPUT);
     digitalWrite(LOOP_LED, LOW); // LED on
+    RuntimeStats::begin();
+
+    for(size_t i = 0; i < kAxisCount; i++)
+        axes[i].motionVisor.begin(kAxisPins[i]);
 
-    fusionBus.onCommunicate([&](const std::string& json) -> std::optional<std::string>
+    StoredConfigs storedConfigs;
+    if(configJournal.load(storedConfigs)) // boot with the last config the master sent, no push needed
+    {
+        for(size_t i = 0; i < kAxisCount; i++)
+        {
+            axes[i].motionVisor.setConfig(storedConfigs.axis[i].toConfig());
+            axes[i].groupId = storedConfigs.axis[i].groupId;
+            axes[i].slot = storedConfigs.axis[i].slot;
+        }
+        if(std::find(std::begin(kSupportedBauds), std::end(kSupportedBauds), storedConfigs.baud) != std::end(kSupportedBauds))
+            storedBaud = storedConfigs.baud;
+        Serial.println("Config: restored from flash");
+    }
+    StoredPositions storedPositions;
+    if(positionJournal.load(storedPositions))
+    {
+        for(size_t i = 0; i < kAxisCount; i++)
+        {
+            const StoredPosition& stored = storedPositions.axis[i];
+            if(!stored.valid or positionJournal.marked(i)) // marked: the vent moved since, see checkpointPositions()
+                continue;
+            axes[i].checkpoint = (long)stored.step; // cleared by checkpointPositions() if it isn't taken over
+            if(axes[i].motionVisor.restorePosition(stored.step)) // no homing run after a clean power loss
+            {
+                Serial.print("Position: restored from flash, id ");
+                Serial.println(axes[i].id);
+            }
+        }
+    }
+
+    fusionBus.onCommunicate([&](std::string_view json, FusionBusSlave::Response& response) -> bool
     {
         // parse and check json validity using ArduinoJson c++
         JsonDocument doc;
-        if(deserializeJson(doc, json) == DeserializationError::Ok) // successful parse (valid json)
+        DeserializationError error;
+        {
+            RuntimeStats::Scope timing(RuntimeStats::Timing::Json);
+            error = deserializeJson(doc, json.data(), json.size());
+        }
+        if(error == DeserializationError::Ok) // successful parse (valid json)
         {
-            Serial.println((std::string("id = ") + std::to_string(doc["id"].as<uint32_t>())).c_str());
+            // multicast frames carry no top-level id and are never answered
+            if(doc["targets"].is<JsonArrayConst>()) // {"targets":[[id, ventingPercent], ...]}
+            {
+                for(JsonArrayConst target : doc["targets"].as<JsonArrayConst>())
+                {
+                    if(Axis* axis = findAxis(target[0].as<uint32_t>()))
+                        axis->motionVisor.setVentingPercent(target[1].as<int>());
+                }
+                return false;
+            }
+            if(doc.containsKey("baudSwitch")) // {"baudSwitch":rate[, "inMs":ms]}, the boards that acknowledged this rate switch together
+            {
+                if(acceptedBaud != 0 and (doc["baudSwitch"] | 0UL) == acceptedBaud)
+                {
+                    baudSwitchAtMs = millis() + (doc["inMs"] | kBaudSwitchDelayMs);
+                    baudSwitchPending = true;
+                }
+                else
+                {
+                    acceptedBaud = 0;
+                }
+                return false;
+            }
+            if(doc.containsKey("poll")) // {"poll":"status"[, "slotMs":ms]}, every device with a slot answers in its own window
+            {
+                if(doc["poll"] != "status")
+                    return false;
+                return writePolledStatus(response, doc["slotMs"] | statusSlotMs());
+            }
+            if(doc.containsKey("group")) // {"group":groupId, "ventingPercent":percent}, group 0 addresses every device
+            {
+                const uint32_t group = doc["group"].as<uint32_t>();
+                if(!doc.containsKey("ventingPercent"))
+                    return false;
+                for(Axis& axis : axes)
+                {
+                    if(group == 0 or group == axis.groupId)
+                        axis.motionVisor.setVentingPercent(doc["ventingPercent"].as<int>());
+                }
+                return false;
+            }
+
             // process json commands
-            if(doc["id"].as<uint32_t>() == id) // Only process if id Matches,
+            if(Axis* axis = findAxis(doc["id"].as<uint32_t>())) // Only process if id Matches,
             {
+                confirmBaud();
+                if(doc.containsKey("baud")) // {"id":..,"baud":rate} proposes a bus rate for the whole board
+                    return acknowledgeBaud(response, doc["baud"] | 0UL);
+#ifdef VENTDRIVE_STATS
+                if(doc.containsKey("stats")) // {"id":..,"stats":"step"|"loop"|"work"|"json"|"counters"|"reset"}, board-wide
+                    return RuntimeStats::write(response, doc["stats"] | "");
+#endif
+#ifdef FUSIONBUS_CAPTURE
+                if(doc.containsKey("capture")) // {"id":..,"capture":offset} reads the bus capture out, {"id":..,"capture":"clear"} records anew
+                {
+                    if(doc["capture"] == "clear")
+                    {
+                        fusionBus.capture().clear();
+                        return writeCapture(response, 0);
+                    }
+                    fusionBus.capture().freeze(); // the read-out doesn't capture itself
+                    return writeCapture(response, doc["capture"] | 0UL);
+                }
+#endif
+                MotionVisor& motionVisor = axis->motionVisor;
                 digitalWrite(COM_LED, HIGH);
                 auto mvConfig = motionVisor.getConfig();
                 if(doc.containsKey("acceleration")) mvConfig.acceleration = doc["acceleration"].as<double>();
@@ -48,64 +166,324 @@ void SystemFacade::begin()
                 if(doc.containsKey("stepPermm")) mvConfig.stepPermm = doc["stepPermm"].as<double>();
                 if(doc.containsKey("maxCompensation")) mvConfig.maxCompensation = doc["maxCompensation"].as<double>();
                 if(doc.containsKey("endstopExtraDistance")) mvConfig.endstopExtraDistance = doc["endstopExtraDistance"].as<double>();
+                if(doc.containsKey("homingSpeed")) mvConfig.homingSpeed = doc["homingSpeed"].as<double>();
+                if(doc.containsKey("homingSlowSpeed")) mvConfig.homingSlowSpeed = doc["homingSlowSpeed"].as<double>();
+                if(doc.containsKey("homingBackoff")) mvConfig.homingBackoff = doc["homingBackoff"].as<double>();
+                if(doc.containsKey("endstopDebounce")) mvConfig.endstopDebounce = doc["endstopDebounce"].as<double>();
                 if(doc.containsKey("ventingPercent")) motionVisor.setVentingPercent(doc["ventingPercent"].as<int>());
+                for(JsonArrayConst segment : doc["queue"].as<JsonArrayConst>()) // {"queue":[[percent, holdMs], ...]}, appended
+                    motionVisor.queueVentingPercent(segment[0].as<int>(), segment[1] | 0UL);
+                std::optional<bool> scheduled; // answered as "schedule":true|false, a rejected schedule leaves the running one
+                if(doc.containsKey("schedule")) // {"schedule":{"points":[[seconds, percent], ...], "period":86400, "now":seconds}}, null stops it
+                {
+                    // not journaled: after a power loss the board doesn't know the time to resume it at,
+                    // the master sends it again with "now"
+                    JsonArrayConst points = doc["schedule"]["points"].as<JsonArrayConst>();
+                    if(points.size() == 0)
+                    {
+                        motionVisor.clearSchedule();
+                        scheduled = true;
+                    }
+                    else if(points.size() > MotionVisor::kMaxSchedulePoints)
+                    {
+                        scheduled = false;
+                    }
+                    else
+                    {
+                        MotionVisor::SchedulePoint schedule[MotionVisor::kMaxSchedulePoints];
+                        size_t count = 0;
+                        for(JsonArrayConst point : points)
+                            schedule[count++] = {point[0].as<uint32_t>(), point[1].as<uint8_t>()};
+                        scheduled = motionVisor.setSchedule(schedule, count, doc["schedule"]["period"] | 0UL, doc["schedule"]["now"] | 0UL);
+                    }
+                }
                 if(doc.containsKey("invertDir")) mvConfig.invertDir = doc["invertDir"].as<bool>();
                 if(doc.containsKey("invertEndstopPin")) mvConfig.invertEndstopPin = doc["invertEndstopPin"].as<bool>();
+                if(doc.containsKey("groupId")) axis->groupId = doc["groupId"].as<uint32_t>();
+                if(doc.containsKey("slot")) axis->slot = doc["slot"] | -1; // consecutive for the axes of one board, see writePolledStatus
                 motionVisor.setConfig(mvConfig);
+                configDirty = true; // the journal skips the write if nothing changed
                 
                 if((doc["autoHomeFlag"] | false) == true) motionVisor.autoHome();
+                if(doc.containsKey("binary")) fusionBus.setBinaryMode(doc["binary"].as<bool>()); // this reply still goes out as text
                 
-                JsonDocument responseDoc;
-                if(motionVisor.state() == MotionVisorState::Closing)
-                    responseDoc["state"] = "Closing";
-                if(motionVisor.state() == MotionVisorState::Opening)
-                    responseDoc["state"] = "Opening";
-                if(motionVisor.state() == MotionVisorState::Idle)
-                    responseDoc["state"] = "Idle";
-                if(motionVisor.state() == MotionVisorState::Error)
-                    responseDoc["state"] = "Error";
-                if(motionVisor.state() == MotionVisorState::Uninitialized)
-                    responseDoc["state"] = "Uninitialized";
-                
-                if(motionVisor.ventingPercent().has_value())
-                    responseDoc["ventingPercent"] = motionVisor.ventingPercent().value();
-                else
-                    responseDoc["ventingPercent"] = nullptr;
-                responseDoc["type"] = "VentDrive";
-                std::string response;
-                serializeJsonPretty(responseDoc, response);
-
-                return response;
+                if(!writeStatus(response, *axis, false))
+                    return false;
+                return !scheduled or (response.resize(response.size() - 1) and // into the status object
+                                      response.append(*scheduled ? ",\"schedule\":true}" : ",\"schedule\":false}"));
             }
         }
-        return std::nullopt;
+        return false;
     }); 
-    fusionBus.onPair([&]() -> std::optional<std::string> 
+    fusionBus.onBinary([&](const uint8_t* payload, size_t size, FusionBusSlave::Response& response) -> bool
+    {
+        FusionBusBinary::Command command;
+        if(size != sizeof(command))
+            return false;
+        memcpy(&command, payload, sizeof(command));
+        Axis* axis = findAxis(command.id);
+        if(command.version != FusionBusBinary::kVersion or 
+           command.opcode != (uint8_t)FusionBusBinary::Opcode::Command or 
+           axis == nullptr)
+            return false;
+        confirmBaud();
+
+        MotionVisor& motionVisor = axis->motionVisor;
+        digitalWrite(COM_LED, HIGH);
+        if(command.flags & FusionBusBinary::kSetVentingPercent) motionVisor.setVentingPercent(command.ventingPercent);
+        if(command.flags & FusionBusBinary::kAutoHome) motionVisor.autoHome();
+        if(command.flags & FusionBusBinary::kTextMode) fusionBus.setBinaryMode(false); // this reply still goes out as binary
+
+        FusionBusBinary::Status status;
+        status.version = FusionBusBinary::kVersion;
+        status.opcode = (uint8_t)FusionBusBinary::Opcode::Status;
+        status.id = axis->id;
+        status.state = (uint8_t)motionVisor.state();
+        const std::optional<int> percent = motionVisor.ventingPercent(); // one snapshot read
+        status.ventingPercent = percent.has_value() ? (uint8_t)percent.value() : FusionBusBinary::kUnknownPercent;
+        return response.assign((const char*)&status, sizeof(status));
+    });
+    fusionBus.setAddressFilter([&](uint32_t frameId) { return findAxis(frameId) != nullptr; }); // skip other devices' frames unparsed
+    fusionBus.onPair([&](FusionBusSlave::Response& response) -> bool 
     {
         if(!digitalRead(PAIR_BTN)) // if pairing button is pushed
         {
             JsonDocument doc;
-            doc["id"] = id;
+            doc["id"] = axes[0].id;
+            if(kAxisCount > 1) // the other axes follow on consecutive ids
+                doc["axes"] = kAxisCount;
             doc["type"] = "VentDrive";
-            std::string response;
-            serializeJson(doc, response);
-            return response;
+            return response.resize(serializeJson(doc, response.data(), response.capacity()));
         }
-        return std::nullopt;
+        return false;
     });
-    fusionBus.begin(38400);
+    fusionBus.begin(storedBaud);
+}
+
+SystemFacade::Axis* SystemFacade::findAxis(uint32_t id)
+{
+    for(Axis& axis : axes)
+    {
+        if(axis.id == id)
+            return &axis;
+    }
+    return nullptr;
+}
+
+bool SystemFacade::anyAxisMoving() const
+{
+    for(const Axis& axis : axes)
+    {
+        if(axis.motionVisor.state() == MotionVisorState::Opening or axis.motionVisor.state() == MotionVisorState::Closing)
+            return true;
+    }
+    return false;
+}
+
+// every axis took what was posted to it and none moves: a flash write may stall the CPU now
+bool SystemFacade::allAxesAtRest() const
+{
+    for(const Axis& axis : axes)
+    {
+        if(!axis.motionVisor.commandsTaken())
+            return false;
+    }
+    return !anyAxisMoving();
+}
+
+// polled replies carry the id, since the master can't tell the slots apart otherwise
+bool SystemFacade::writeStatus(FusionBusSlave::Response& response, Axis& axis, bool polled)
+{
+    MotionVisor& motionVisor = axis.motionVisor;
+    return VentStatus::write(response, motionVisor.state(), motionVisor.ventingPercent(), 
+                             motionVisor.queuedSegments(), MotionVisor::kQueueDepth,
+                             polled ? std::optional<uint32_t>(axis.id) : std::nullopt);
+}
+
+// The board answers once, in the lowest slot of its polled axes; with several polled axes the
+// reply is a JSON array of their statuses. The slots of the other axes stay silent, and the
+// reply runs on through them: statusSlotMs() is sized for one status, so the master must give
+// a board's axes consecutive slots, or the array overlaps the next board's window.
+bool SystemFacade::writePolledStatus(FusionBusSlave::Response& response, unsigned long slotMs)
+{
+    int firstSlot = -1;
+    size_t polledCount = 0;
+    for(const Axis& axis : axes)
+    {
+        if(axis.slot < 0)
+            continue;
+        if(firstSlot < 0 or axis.slot < firstSlot)
+            firstSlot = axis.slot;
+        polledCount++;
+    }
+    if(polledCount == 0)
+        return false;
+    fusionBus.deferResponse(firstSlot * slotMs);
+
+    response.clear();
+    bool ok = polledCount == 1 or response.append("[");
+    size_t written = 0;
+    for(Axis& axis : axes)
+    {
+        if(axis.slot < 0)
+            continue;
+        ok = ok and (written++ == 0 or response.append(","));
+        ok = ok and VentStatus::append(response, axis.motionVisor.state(), axis.motionVisor.ventingPercent(), 
+                                       axis.motionVisor.queuedSegments(), MotionVisor::kQueueDepth, axis.id);
+    }
+    return ok and (polledCount == 1 or response.append("]"));
+}
+
+#ifdef FUSIONBUS_CAPTURE
+// {"capture":offset,"size":..,"dropped":..,"hex":".."}, kCaptureChunk bytes from offset in hex;
+// the host concatenates the chunks into a capture file for test/test_replay
+bool SystemFacade::writeCapture(FusionBusSlave::Response& response, size_t offset)
+{
+    static constexpr char kHex[] = "0123456789abcdef";
+    const FusionBusSlave::Capture& capture = fusionBus.capture();
+    const size_t end = std::min(capture.size(), offset + kCaptureChunk);
+    response.clear();
+    bool ok = response.append("{\"capture\":") and VentStatus::appendUnsigned(response, offset) and
+              response.append(",\"size\":") and VentStatus::appendUnsigned(response, capture.size()) and
+              response.append(",\"dropped\":") and VentStatus::appendUnsigned(response, capture.dropped()) and
+              response.append(",\"hex\":\"");
+    for(size_t i = offset; ok and i < end; i++)
+        ok = response.push_back(kHex[capture.data()[i] >> 4]) and response.push_back(kHex[capture.data()[i] & 0x0F]);
+    return ok and response.append("\"}");
+}
+#endif
+
+// {"baud":rate,"ack":true|false}; an acknowledged rate waits for the multicast baudSwitch
+bool SystemFacade::acknowledgeBaud(FusionBusSlave::Response& response, unsigned long baud)
+{
+    const bool supported = std::find(std::begin(kSupportedBauds), std::end(kSupportedBauds), baud) != std::end(kSupportedBauds);
+    acceptedBaud = supported ? baud : 0;
+    response.clear();
+    return response.append("{\"baud\":") and VentStatus::appendUnsigned(response, baud) and
+           response.append(supported ? ",\"ack\":true}" : ",\"ack\":false}");
+}
+
+// Runs a scheduled switch, then watches the new rate. Unconfirmed after kBaudProbationMs,
+// the board returns to kBaseBaud for good. With no frame on the line for kLinkLossMs it
+// returns for now, without a flash write: a quiet master is normal with schedules running,
+// and a board booting at a stored raised rate falls back the same way.
+void SystemFacade::superviseBaud()
+{
+    const unsigned long now = millis();
+    if(baudSwitchPending)
+    {
+        if((long)(now - baudSwitchAtMs) < 0)
+            return;
+        baudSwitchPending = false;
+        changeBaud(acceptedBaud);
+        acceptedBaud = 0;
+        baudProbation = true;
+        return;
+    }
+    const bool unconfirmed = baudProbation and now - baudChangedMs > kBaudProbationMs;
+    const bool lost = fusionBus.baud() != kBaseBaud and now - baudChangedMs > kLinkLossMs and now - fusionBus.lastFrameMs() > kLinkLossMs;
+    if(unconfirmed)
+    {
+        storedBaud = kBaseBaud;
+        configDirty = true;
+    }
+    if(unconfirmed or lost)
+    {
+        baudProbation = false;
+        changeBaud(kBaseBaud);
+    }
+}
+
+// a frame addressed to the board, text or binary: the master reaches it at the new rate, keep it
+void SystemFacade::confirmBaud()
+{
+    if(!baudProbation)
+        return;
+    baudProbation = false;
+    storedBaud = fusionBus.baud();
+    configDirty = true;
+}
+
+void SystemFacade::changeBaud(unsigned long baud)
+{
+    fusionBus.setBaud(baud);
+    baudChangedMs = millis();
+}
+
+// one status reply on the wire (10 bits per byte) plus a quiet gap between slots
+unsigned long SystemFacade::statusSlotMs() const
+{
+    const unsigned long baud = fusionBus.baud() ? fusionBus.baud() : kBaseBaud;
+    return (kStatusReplyMaxBytes * 10 * 1000 + baud - 1) / baud + kSlotGapMs;
+}
+
+// A checkpoint is only valid while the vent stands still. When a vent starts to move, its
+// mark on the journaled record voids it: one halfword written in place, no erase, so the
+// step interrupt of the other axes barely notices. New positions are written like the
+// config, once no vent moves; all axes share one record.
+void SystemFacade::checkpointPositions()
+{
+    std::optional<long> positions[kAxisCount];
+    for(size_t i = 0; i < kAxisCount; i++)
+    {
+        const MotionVisor& motionVisor = axes[i].motionVisor;
+        if(!motionVisor.commandsTaken())
+            return; // its state doesn't reflect the last command yet, e.g. a restore at startup
+        positions[i] = motionVisor.state() == MotionVisorState::Idle ? motionVisor.position() : std::nullopt;
+        if(!positions[i] and axes[i].checkpoint and positionJournal.mark(i))
+            axes[i].checkpoint = std::nullopt;
+    }
+    bool changed = false;
+    for(size_t i = 0; i < kAxisCount; i++)
+        changed = changed or positions[i] != axes[i].checkpoint;
+    if(!changed or anyAxisMoving())
+        return;
+    StoredPositions stored;
+    for(size_t i = 0; i < kAxisCount; i++)
+    {
+        stored.axis[i].valid = positions[i].has_value();
+        stored.axis[i].step = positions[i].value_or(0);
+    }
+    if(positionJournal.store(stored))
+    {
+        for(size_t i = 0; i < kAxisCount; i++)
+            axes[i].checkpoint = positions[i];
+    }
 }
 
 void SystemFacade::loop()
 {
+    RuntimeStats::beginLoop();
     fusionBus.loop();
+    superviseBaud();
     digitalWrite(COM_LED, LOW);
-    motionVisor.loop();
+    for(Axis& axis : axes)
+        axis.motionVisor.loop();
+    // one journal store per pass: two page erases back to back would outlast the DMA ring
+    const bool storeConfig = configDirty and allAxesAtRest();
+    if(storeConfig)
+    {
+        StoredConfigs stored;
+        for(size_t i = 0; i < kAxisCount; i++)
+            stored.axis[i] = StoredConfig::from(axes[i].motionVisor.getConfig(), axes[i].groupId, axes[i].slot);
+        stored.baud = storedBaud;
+        configJournal.store(stored);
+        configDirty = false;
+    }
+    else
+    {
+        checkpointPositions();
+    }
     if(loopLedMillis + 1000 < millis())
     {
         digitalToggle(LOOP_LED);
         loopLedMillis = millis();
     }
+    RuntimeStats::endLoop();
+    // Sleep until the next interrupt. SysTick wakes the core every millisecond at the latest,
+    // which keeps millis() timeouts, the LED and the DMA receive poll going; UART, EXTI and
+    // the step timer wake it sooner. With every axis parked nothing else runs.
+    __WFI();
 }
 
 SystemFacade::~SystemFacade() {}
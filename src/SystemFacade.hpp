@@ -1,18 +1,89 @@
 #pragma once
 #include "MotionVisor.hpp"
 #include "FusionBusSlave.hpp"
+#include "FlashJournal.hpp"
+#include "StoredConfig.hpp"
+#include "StoredPosition.hpp"
+
+#ifndef VENTDRIVE_AXES
+#define VENTDRIVE_AXES 1 // vents on this board, axis i answers to FusionBus id + i
+#endif
 
 class SystemFacade
 {
 public:
+    static constexpr size_t kAxisCount = VENTDRIVE_AXES;
+    static_assert(kAxisCount >= 1 and kAxisCount <= StepScheduler::kMaxAxes, "VENTDRIVE_AXES out of range");
+
     SystemFacade(uint32_t id = 123456789);
     void begin();
     void loop();
     ~SystemFacade();
 
 private:
-    uint32_t id;
+    struct Axis
+    {
+        uint32_t id = 0;
+        uint32_t groupId = 0; // multicast group, assigned by the master ("groupId"); 0 = broadcast only
+        int slot = -1; // status poll reply slot, assigned by the master ("slot"); -1 = not polled
+        MotionVisor motionVisor;
+        std::optional<long> checkpoint; // position held by positionJournal, nullopt = none/moving
+    };
+    // one record per journal covers every axis; the axis count is part of the version,
+    // so a record written by a build with another count is ignored, and so is the
+    // layout of StoredConfigs around the axes (kConfigsLayout)
+    struct __attribute__((packed)) StoredConfigs { StoredConfig axis[kAxisCount]; uint32_t baud; };
+    struct StoredPositions { StoredPosition axis[kAxisCount]; };
+    static constexpr uint16_t kConfigsLayout = 1; // 1: the bus rate follows the axes
+    static constexpr uint16_t kConfigVersion = StoredConfig::kVersion | (kAxisCount - 1) << 8 | kConfigsLayout << 12;
+    static constexpr uint16_t kPositionVersion = StoredPosition::kVersion | (kAxisCount - 1) << 8;
+
+    Axis* findAxis(uint32_t id);
+    bool anyAxisMoving() const;
+    bool allAxesAtRest() const;
+    bool writeStatus(FusionBusSlave::Response& response, Axis& axis, bool polled);
+    bool writePolledStatus(FusionBusSlave::Response& response, unsigned long slotMs);
+    unsigned long statusSlotMs() const;
+#ifdef FUSIONBUS_CAPTURE
+    bool writeCapture(FusionBusSlave::Response& response, size_t offset);
+    static constexpr size_t kCaptureChunk = 128; // capture bytes per reply, twice that in hex
+#endif
+    void checkpointPositions();
+    bool acknowledgeBaud(FusionBusSlave::Response& response, unsigned long baud);
+    void superviseBaud();
+    void confirmBaud();
+    void changeBaud(unsigned long baud);
+
+    static constexpr unsigned long kStatusReplyMaxBytes = 128; // polled VentStatus line incl. line ending
+    static constexpr unsigned long kSlotGapMs = 2;
+    // the board answers a poll for all its axes at once: "[", the statuses without line ending, "," between, "]"
+    static_assert(kAxisCount * (kStatusReplyMaxBytes - 1) + 1 <= FusionBusSlave::Response::capacity(),
+                  "a polled reply for every axis must fit the FusionBus response buffer");
+    // Bus rate negotiation: {"id":..,"baud":rate} to every board, then one multicast
+    // {"baudSwitch":rate,"inMs":ms}; a frame addressed to the board at the new rate confirms
+    // it, otherwise the board falls back to kBaseBaud, where the master can always find it
+    static constexpr unsigned long kBaseBaud = 38400;
+    static constexpr unsigned long kSupportedBauds[] = {38400, 57600, 115200, 230400}; // the top rate bounded by the DMA ring, see below
+    static constexpr unsigned long kBaudSwitchDelayMs = 20; // default "inMs"; the master waits a few ms more, boards switch on their next loop pass
+    static constexpr unsigned long kBaudProbationMs = 3000;
+    static constexpr unsigned long kLinkLossMs = 60000; // no frame at a raised rate for this long: back to kBaseBaud, the stored rate kept
+    // a journal page erase stalls the loop while the bus keeps talking; the receive ring must hold it all
+    static_assert(std::end(kSupportedBauds)[-1] / 10 * FlashJournal<StoredConfigs, kConfigVersion>::kEraseStallMaxMs / 1000 <= FusionBusSlave::kDmaRxSize,
+                  "the fastest bus rate overruns the DMA receive ring during a flash page erase");
+    // last two 1 KB pages of the 64 KB part, kept out of the firmware image in platformio.ini
+    static constexpr uint32_t kConfigJournalOffset = 62 * 1024;
+    static constexpr uint32_t kPositionJournalOffset = 60 * 1024; // the two pages below
+
     FusionBusSlave fusionBus;
-    MotionVisor motionVisor;
+    Axis axes[kAxisCount];
+    FlashJournal<StoredConfigs, kConfigVersion> configJournal;
+    bool configDirty = false; // stored once every vent stands still, flash writes stall the CPU
+    unsigned long storedBaud = kBaseBaud; // journaled with the config, the rate the board boots at
+    unsigned long acceptedBaud = 0; // acknowledged proposal waiting for its baudSwitch, 0 = none
+    unsigned long baudSwitchAtMs = 0;
+    bool baudSwitchPending = false;
+    bool baudProbation = false; // switched, not confirmed by the master yet
+    unsigned long baudChangedMs = 0;
+    FlashJournal<StoredPositions, kPositionVersion, kAxisCount> positionJournal; // a mark per axis voids its checkpoint
     long long loopLedMillis;
 };
@@ -0,0 +1,66 @@
+#pragma once
+#include <Arduino.h>
+#include <cstdint>
+#include <cstddef>
+
+// USART1 receive through DMA1 channel 5 into a circular buffer. Reception keeps
+// running while the main loop is busy; poll() hands everything that arrived since
+// the last call to the sink as at most two contiguous chunks (split at the wrap).
+// Size must cover the longest main-loop stall at the bus baud rate.
+template<size_t Size>
+class UartDmaRx
+{
+public:
+    // call after HardwareSerial::begin(), which enables the RXNE, PE and error
+    // interrupts again
+    void begin()
+    {
+        RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+        DMA1_Channel5->CCR = 0;
+        DMA1_Channel5->CPAR = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&USART1->DR));
+        DMA1_Channel5->CMAR = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(buffer_));
+        DMA1_Channel5->CNDTR = Size;
+        DMA1_Channel5->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_PL_1 | DMA_CCR_EN; // 8-bit, peripheral to memory
+        USART1->CR1 &= ~(USART_CR1_RXNEIE | USART_CR1_PEIE); // bytes no longer go through the HardwareSerial ring buffer
+        // With DMAR set, an FE/NE/ORE interrupt sends HAL_UART_IRQHandler down its DMA
+        // error path, which clears DMAR and re-arms 1-byte interrupt reception that is
+        // never read. The caller counts the errors from SR instead.
+        USART1->CR3 &= ~USART_CR3_EIE;
+        USART1->CR3 |= USART_CR3_DMAR;
+        readIndex_ = 0;
+    }
+
+    void end()
+    {
+        USART1->CR3 &= ~USART_CR3_DMAR;
+        DMA1_Channel5->CCR = 0;
+    }
+
+    // bytes received that poll() has not handed out yet
+    size_t pending() const
+    {
+        const size_t writeIndex = (Size - DMA1_Channel5->CNDTR) % Size;
+        return (writeIndex + Size - readIndex_) % Size;
+    }
+
+    template<typename Sink>
+    void poll(Sink&& sink)
+    {
+        const size_t writeIndex = (Size - DMA1_Channel5->CNDTR) % Size;
+        if (writeIndex == readIndex_) return;
+        if (writeIndex > readIndex_)
+        {
+            sink(buffer_ + readIndex_, writeIndex - readIndex_);
+        }
+        else
+        {
+            sink(buffer_ + readIndex_, Size - readIndex_);
+            if (writeIndex) sink(buffer_, writeIndex);
+        }
+        readIndex_ = writeIndex;
+    }
+
+private:
+    uint8_t buffer_[Size];
+    size_t readIndex_ = 0;
+};
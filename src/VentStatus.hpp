@@ -0,0 +1,68 @@
+#pragma once
+#include "MotionVisorState.hpp"
+#include "FixedBuffer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// Compact JSON status reply, written straight into the response buffer (no JsonDocument):
+// {"id":42,"state":"Idle","ventingPercent":50,"queued":2,"queueDepth":8,"type":"VentDrive"},
+// "id" only when asked for; append() lets several statuses share one reply
+namespace VentStatus
+{
+    // indexed by MotionVisorState
+    constexpr std::string_view kStateNames[] = {"Closing", "Opening", "Idle", "Error", "Uninitialized"};
+    static_assert(sizeof(kStateNames) / sizeof(kStateNames[0]) == (size_t)MotionVisorState::Uninitialized + 1, 
+                  "kStateNames must cover every MotionVisorState");
+
+    constexpr std::string_view stateName(MotionVisorState state)
+    {
+        return (size_t)state < sizeof(kStateNames) / sizeof(kStateNames[0]) ? kStateNames[(size_t)state] : "Unknown";
+    }
+
+    template<size_t Capacity>
+    bool appendUnsigned(FixedBuffer<Capacity>& out, uint32_t value)
+    {
+        char digits[10];
+        size_t count = 0;
+        do
+        {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value != 0);
+        while (count > 0)
+            if (!out.push_back(digits[--count])) return false;
+        return true;
+    }
+
+    template<size_t Capacity>
+    bool append(FixedBuffer<Capacity>& out, MotionVisorState state, std::optional<int> ventingPercent, 
+                uint32_t queued, uint32_t queueDepth, std::optional<uint32_t> id = std::nullopt)
+    {
+        bool ok = out.append("{");
+        if (id.has_value())
+            ok = ok && out.append("\"id\":") && appendUnsigned(out, id.value()) && out.append(",");
+        ok = ok && out.append("\"state\":\"") && out.append(stateName(state)) && out.append("\",\"ventingPercent\":");
+        if (ventingPercent.has_value())
+        {
+            if (ventingPercent.value() < 0)
+                ok = ok && out.push_back('-') && appendUnsigned(out, (uint32_t)(-(int64_t)ventingPercent.value()));
+            else
+                ok = ok && appendUnsigned(out, (uint32_t)ventingPercent.value());
+        }
+        else
+            ok = ok && out.append("null");
+        ok = ok && out.append(",\"queued\":") && appendUnsigned(out, queued);
+        ok = ok && out.append(",\"queueDepth\":") && appendUnsigned(out, queueDepth);
+        return ok && out.append(",\"type\":\"VentDrive\"}");
+    }
+
+    template<size_t Capacity>
+    bool write(FixedBuffer<Capacity>& out, MotionVisorState state, std::optional<int> ventingPercent, 
+               uint32_t queued, uint32_t queueDepth, std::optional<uint32_t> id = std::nullopt)
+    {
+        out.clear();
+        return append(out, state, ventingPercent, queued, queueDepth, id);
+    }
+}
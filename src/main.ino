@@ -1,5 +1,3 @@
-#define SERIAL_RX_BUFFER_SIZE 4096
-#define SERIAL_TX_BUFFER_SIZE 4096
 #include "SystemFacade.hpp"
 
 #define ID1 123456789
@@ -0,0 +1,122 @@
+// Host micro-benchmarks for the hot paths: run with `pio test -e native -v`
+// to see the ns/op figures printed by each test.
+#include <unity.h>
+#include <chrono>
+#include <string>
+#include "NativeHal.h"
+#include "SystemFacade.hpp"
+
+namespace
+{
+    constexpr uint32_t kDeviceId = 42;
+    constexpr unsigned long kTurnaroundUs = 10000; // FusionBusSlave::Timeouts::turnaroundGuardMs
+
+    using Clock = std::chrono::steady_clock;
+
+    double nsSince(Clock::time_point start, double operations)
+    {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+        return (double)elapsed.count() / operations;
+    }
+
+    void report(const char* what, double ns)
+    {
+        char message[96];
+        snprintf(message, sizeof(message), "%s: %.1f ns", what, ns);
+        TEST_MESSAGE(message);
+    }
+
+    std::string frame(uint32_t id, int ventingPercent)
+    {
+        return "FusionBusCommunicate {\"id\":" + std::to_string(id) + ",\"ventingPercent\":" + std::to_string(ventingPercent) + "}\n";
+    }
+}
+
+void setUp()
+{
+    NativeHal::reset();
+}
+
+void tearDown() {}
+
+// StepScheduler interrupts while the vent ramps between half and fully open; tickless, so
+// every interrupt is a step and the timer stops once the vent arrives
+void bench_stepper_tick()
+{
+    MotionVisor motionVisor;
+    motionVisor.begin();
+    NativeHal::setPin(PB1, LOW); // endstop pressed (inverted input), homes instantly
+    motionVisor.autoHome();
+    NativeHal::tickTimers(); // the interrupt takes the command
+    NativeHal::setPin(PB1, HIGH); // off the endstop for the moves
+
+    constexpr int kMoves = 20;
+    long fired = 0;
+    const auto start = Clock::now();
+    for(int move = 0; move < kMoves; ++move)
+    {
+        motionVisor.setVentingPercent(move % 2 == 0 ? 100 : 50);
+        for(; StepScheduler::instance().running(); ++fired)
+        {
+            NativeHal::tickTimers();
+            NativeHal::advanceMicros(StepScheduler::kTickUs); // lets a debounced EXTI endstop latch
+        }
+    }
+    report("StepScheduler interrupt", nsSince(start, fired));
+    TEST_ASSERT_EQUAL_INT(50, motionVisor.ventingPercent().value_or(0));
+    TEST_ASSERT_FALSE(StepScheduler::instance().running()); // parked at the goal
+}
+
+// FusionBusSlave parser fed with traffic addressed to other devices and line noise
+void bench_parser_bytes()
+{
+    FusionBusSlave fusionBus("Ventdrive");
+    fusionBus.onCommunicate([](std::string_view, FusionBusSlave::Response&) -> bool { return false; });
+    fusionBus.setAddressFilter([](uint32_t id) { return id == kDeviceId; });
+    fusionBus.begin(38400);
+
+    std::string traffic;
+    for(int i = 0; i < 64; ++i)
+        traffic += frame(1000 + i, i) + "noise FusionBu FusionBusPai\n";
+
+    constexpr int kRounds = 2000;
+    const auto start = Clock::now();
+    for(int i = 0; i < kRounds; ++i)
+    {
+        NativeHal::serialInject(USART1, traffic);
+        fusionBus.loop();
+    }
+    report("FusionBusSlave per byte", nsSince(start, (double)kRounds * traffic.size()));
+}
+
+// A full addressed Communicate round trip through SystemFacade, including the reply
+void bench_communicate_frame()
+{
+    SystemFacade system(kDeviceId);
+    system.begin();
+    NativeHal::serialTakeOutput(USART1);
+
+    constexpr int kFrames = 5000;
+    int replies = 0;
+    const auto start = Clock::now();
+    for(int i = 0; i < kFrames; ++i)
+    {
+        NativeHal::serialInject(USART1, frame(kDeviceId, i % 100));
+        system.loop();
+        NativeHal::advanceMicros(kTurnaroundUs);
+        system.loop(); // guard time over, the reply is queued
+        system.loop(); // TX complete, back to Idle
+        replies += !NativeHal::serialTakeOutput(USART1).empty();
+    }
+    report("SystemFacade per Communicate frame", nsSince(start, kFrames));
+    TEST_ASSERT_EQUAL_INT(kFrames, replies);
+}
+
+int main(int argc, char** argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(bench_stepper_tick);
+    RUN_TEST(bench_parser_bytes);
+    RUN_TEST(bench_communicate_frame);
+    return UNITY_END();
+}
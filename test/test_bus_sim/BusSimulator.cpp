@@ -0,0 +1,586 @@
+#include "BusSimulator.hpp"
+#include "NativeHal.h"
+#include "SystemFacade.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+    constexpr unsigned long kBitsPerByte = 10; // 8N1
+    constexpr unsigned long kTurnaroundMs = 10; // FusionBusSlave::Timeouts::turnaroundGuardMs
+    constexpr unsigned long kStatusReplyMaxBytes = 128; // as SystemFacade sizes its slots
+    constexpr unsigned long kSlotGapMs = 2;
+    constexpr unsigned long kPowerUpMs = 100; // the master leaves the boot banners alone
+    constexpr unsigned long kQuietMs = 2; // the master talks after this much silence on the line
+    constexpr unsigned long kBaseBaud = 38400; // SystemFacade::kBaseBaud, the devices boot at it
+    constexpr unsigned long kBaudSwitchInMs = 20;
+    constexpr unsigned long kBaudSettleMs = 5; // the master talks at the new rate once every device surely switched
+    constexpr size_t kTargetsPerFrame = 32; // keeps a multicast frame well inside the 1 KB capture buffer
+    constexpr size_t kAxesPerBoard = SystemFacade::kAxisCount; // a board answers to as many consecutive ids
+
+    size_t boardsFor(size_t vents)
+    {
+        return (vents + kAxesPerBoard - 1) / kAxesPerBoard;
+    }
+
+    struct StepHeader
+    {
+        uint64_t untilUs;
+        uint32_t rxCount; // followed by rxCount (value, framing error) byte pairs
+    };
+    // the device answers with a uint32 byte count, its UART output and its UART rate
+
+    uint64_t byteUs(unsigned long baud)
+    {
+        return (kBitsPerByte * 1000000 + baud - 1) / baud;
+    }
+
+    bool sendAll(int fd, const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        while(size > 0)
+        {
+            const ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+            if(sent <= 0)
+                return false;
+            bytes += sent;
+            size -= (size_t)sent;
+        }
+        return true;
+    }
+
+    bool receiveAll(int fd, void* data, size_t size)
+    {
+        uint8_t* bytes = static_cast<uint8_t*>(data);
+        while(size > 0)
+        {
+            const ssize_t received = recv(fd, bytes, size, 0);
+            if(received <= 0)
+                return false;
+            bytes += received;
+            size -= (size_t)received;
+        }
+        return true;
+    }
+
+    double percentile(std::vector<double> values, double share)
+    {
+        if(values.empty())
+            return 0;
+        std::sort(values.begin(), values.end());
+        const size_t rank = (size_t)(share * (values.size() - 1) + 0.5);
+        return values[std::min(rank, values.size() - 1)];
+    }
+}
+
+BusSimulator::BusSimulator(const Options& options):
+    options_(options),
+    devices_(boardsFor(options.devices)),
+    vents_(options.devices),
+    transmitters_(boardsFor(options.devices) + 1),
+    random_(options.seed ? options.seed : 1)
+{
+    const MotionVisorConfig config;
+    const long travelSteps = (long)(config.length * config.stepPermm);
+    for(size_t i = 0; i < vents_.size(); i++)
+    {
+        vents_[i].device = i / kAxesPerBoard;
+        vents_[i].id = options_.firstId + (uint32_t)i; // the ids of a board's axes follow each other
+        vents_[i].report.id = vents_[i].id;
+    }
+    std::fflush(stdout); // the device processes must not flush our buffered output again
+    for(size_t i = 0; i < devices_.size(); i++)
+    {
+        random_ ^= random_ << 13; random_ ^= random_ >> 17; random_ ^= random_ << 5;
+        devices_[i].id = options_.firstId + (uint32_t)(i * kAxesPerBoard);
+        spawn(devices_[i], (long)(random_ % (uint32_t)(travelSteps + 1)));
+    }
+}
+
+BusSimulator::~BusSimulator()
+{
+    for(Device& device : devices_)
+    {
+        if(device.fd >= 0)
+            close(device.fd); // the device process ends on EOF
+        if(device.pid > 0)
+            waitpid(device.pid, nullptr, 0);
+    }
+}
+
+void BusSimulator::spawn(Device& device, long startStep)
+{
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return;
+    const pid_t pid = fork();
+    if(pid == 0)
+    {
+        close(fds[0]);
+        for(const Device& other : devices_)
+            if(other.fd >= 0) close(other.fd);
+        deviceMain(fds[1], device.id, startStep);
+        _exit(0);
+    }
+    close(fds[1]);
+    if(pid < 0)
+    {
+        close(fds[0]);
+        return;
+    }
+    device.pid = pid;
+    device.fd = fds[0];
+    uint32_t baud = 0;
+    if(!receiveAll(device.fd, &baud, sizeof(baud)) or baud != kBaseBaud)
+    {
+        std::fprintf(stderr, "BusSimulator: device %lu boots at %lu baud, the line starts at %lu\n",
+                     (unsigned long)device.id, (unsigned long)baud, kBaseBaud);
+        close(device.fd);
+        device.fd = -1; // deaf, its polls time out
+    }
+    device.baud = baud;
+}
+
+// The device process: one SystemFacade plus the vent it drives. STEP pulses move the vent
+// while the driver is enabled, it stalls at the mechanical stops, and the endstop is
+// pressed from extraDistanceSteps down, where the firmware expects it.
+void BusSimulator::deviceMain(int fd, uint32_t id, long startStep)
+{
+    NativeHal::reset();
+    NativeHal::eraseFlash();
+    const MotionVisorConfig config;
+    const MotionVisor::Pins pins;
+    const long extraSteps = (long)(config.endstopExtraDistance * config.stepPermm);
+    const long lowStop = -(long)(config.maxCompensation * config.stepPermm);
+    const long highStop = (long)((config.length + config.maxCompensation) * config.stepPermm);
+    long position = startStep;
+    auto endstopLevel = [&]() { return (position <= extraSteps) != config.invertEndstopPin ? HIGH : LOW; };
+
+    SystemFacade system(id);
+    system.begin();
+    NativeHal::setPin(pins.endstop, endstopLevel()); // pinMode() pulled it low
+    NativeHal::onPinWrite(pins.step, [&](int level)
+    {
+        if(level != HIGH or NativeHal::pin(pins.en) != LOW)
+            return;
+        const bool forward = NativeHal::pin(pins.dir) == (config.invertDir ? HIGH : LOW);
+        position = std::clamp(position + (forward ? 1 : -1), lowStop, highStop);
+        if(NativeHal::pin(pins.endstop) != endstopLevel())
+            NativeHal::setPin(pins.endstop, endstopLevel());
+    });
+    const uint32_t listening = (uint32_t)NativeHal::serialBaud(USART1);
+    if(!sendAll(fd, &listening, sizeof(listening)))
+        return;
+
+    uint64_t nowUs = 0;
+    std::vector<uint8_t> rx;
+    for(;;)
+    {
+        StepHeader header;
+        if(!receiveAll(fd, &header, sizeof(header)))
+            return;
+        rx.resize(header.rxCount * 2);
+        if(!rx.empty() and !receiveAll(fd, rx.data(), rx.size()))
+            return;
+        for(size_t i = 0; i < rx.size(); i += 2)
+        {
+            if(rx[i + 1])
+                USART1->SR |= USART_SR_FE;
+            NativeHal::serialInject(USART1, &rx[i], 1);
+        }
+        NativeHal::runFor((unsigned long)(header.untilUs - nowUs));
+        nowUs = header.untilUs;
+        system.loop();
+        USART1->SR &= ~USART_SR_FE; // the NativeHal DR read doesn't clear it
+        NativeHal::serialTakeOutput(nullptr); // console
+        const std::string tx = NativeHal::serialTakeOutput(USART1);
+        const uint32_t size = (uint32_t)tx.size();
+        const uint32_t baud = (uint32_t)NativeHal::serialBaud(USART1);
+        if(!sendAll(fd, &size, sizeof(size)) or !sendAll(fd, tx.data(), tx.size()) or !sendAll(fd, &baud, sizeof(baud)))
+            return;
+    }
+}
+
+BusSimulator::Report BusSimulator::run()
+{
+    measureStartUs_ = (uint64_t)(options_.warmupS * 1e6);
+    measureEndUs_ = measureStartUs_ + (uint64_t)(options_.measureS * 1e6);
+    nextCycleUs_ = measureStartUs_;
+    nextMoveUs_ = options_.moveEveryS > 0 ? measureStartUs_ : UINT64_MAX;
+
+    // warm-up: negotiate the line rate, home every vent, and hand out the reply slots for
+    // slotted polling; the setup frames at the new rate also confirm it to the devices
+    if(options_.baud != kBaseBaud)
+    {
+        for(size_t i = 0; i < devices_.size(); i++)
+        {
+            Transaction propose;
+            propose.frame = "{\"id\":" + std::to_string(devices_[i].id) + ",\"baud\":" + std::to_string(options_.baud) + "}";
+            propose.expected = {i * kAxesPerBoard}; // the rate is the board's, its first axis answers
+            propose.waitMs = options_.replyTimeoutMs;
+            script_.push_back(propose);
+        }
+        Transaction change;
+        change.frame = "{\"baudSwitch\":" + std::to_string(options_.baud) + ",\"inMs\":" + std::to_string(kBaudSwitchInMs) + "}";
+        change.waitMs = kBaudSwitchInMs + kBaudSettleMs;
+        change.switchBaud = options_.masterSwitches ? options_.baud : 0;
+        script_.push_back(change);
+    }
+    for(size_t i = 0; i < vents_.size(); i++)
+    {
+        Transaction setup;
+        setup.frame = "{\"id\":" + std::to_string(vents_[i].id) + ",\"autoHomeFlag\":true";
+        if(options_.mode == PollMode::Slotted)
+            setup.frame += ",\"slot\":" + std::to_string(i); // consecutive for the axes of a board
+        setup.frame += "}";
+        setup.expected = {i};
+        setup.waitMs = options_.replyTimeoutMs;
+        script_.push_back(setup);
+    }
+
+    while(nowUs_ < measureEndUs_ or (active_ and current_.measured))
+        step();
+
+    Report report;
+    const double measuredUs = (double)(measureEndUs_ - measureStartUs_);
+    for(Vent& vent : vents_)
+    {
+        DeviceReport& out = vent.report;
+        out.baud = devices_[vent.device].baud;
+        out.p50Ms = percentile(vent.latenciesMs, 0.50);
+        out.p90Ms = percentile(vent.latenciesMs, 0.90);
+        out.p99Ms = percentile(vent.latenciesMs, 0.99);
+        out.maxMs = vent.latenciesMs.empty() ? 0 : *std::max_element(vent.latenciesMs.begin(), vent.latenciesMs.end());
+        report.polls += out.polls;
+        report.replies += out.replies;
+        report.timeouts += out.timeouts;
+        report.corrupt += out.corrupt;
+        report.devices.push_back(out);
+    }
+    report.corrupt += unattributedCorrupt_;
+    report.collisions = collisions_;
+    report.lateCycles = lateCycles_;
+    report.utilisation = measuredUs > 0 ? busyUs_ / measuredUs : 0;
+    report.simulatedS = nowUs_ / 1e6;
+    report.baud = lineBaud_;
+    report.mode = options_.mode;
+    report.pollHz = options_.pollHz;
+    return report;
+}
+
+// One lockstep step: the master acts, bytes that start before the end of the step go on
+// the line, the ones that end in it reach every other node, then the devices run up to the
+// end of the step and hand over what they wrote to their UART.
+void BusSimulator::step()
+{
+    masterSchedule();
+    const uint64_t untilUs = nowUs_ + options_.stepUs;
+    scheduleBytes(untilUs);
+    deliverBytes(untilUs);
+    exchange(untilUs);
+    nowUs_ = untilUs;
+}
+
+// Every node drives the line as soon as its UART has a byte: there is no carrier sense, so
+// two drivers overlap into a wired-AND that every receiver sees with a framing error
+void BusSimulator::scheduleBytes(uint64_t untilUs)
+{
+    for(size_t sender = 0; sender < transmitters_.size(); sender++)
+    {
+        Transmitter& tx = transmitters_[sender];
+        while(!tx.queue.empty())
+        {
+            const uint64_t startUs = std::max(tx.busyUntilUs, tx.queue.front().second);
+            if(startUs >= untilUs)
+                break;
+            const unsigned long baud = sender == devices_.size() ? lineBaud_ : devices_[sender].baud;
+            AirByte byte{startUs, startUs + byteUs(baud), sender, tx.queue.front().first, false, baud};
+            tx.queue.pop_front();
+            tx.busyUntilUs = byte.endUs;
+            for(AirByte& other : air_)
+            {
+                if(other.sender == sender or other.endUs <= byte.startUs or byte.endUs <= other.startUs)
+                    continue;
+                if(!other.collided and measuring())
+                    collisions_++;
+                other.collided = true;
+                other.value &= byte.value;
+                byte.value = other.value;
+                byte.collided = true;
+            }
+            if(byte.collided and measuring())
+                collisions_++;
+            air_.push_back(byte);
+        }
+    }
+}
+
+void BusSimulator::deliverBytes(uint64_t untilUs)
+{
+    std::sort(air_.begin(), air_.end(), [](const AirByte& a, const AirByte& b) { return a.startUs < b.startUs; });
+    const size_t master = devices_.size();
+    for(auto it = air_.begin(); it != air_.end();)
+    {
+        if(it->endUs > untilUs)
+        {
+            ++it;
+            continue;
+        }
+        if(measuring())
+            busyUs_ += it->endUs - std::max(it->startUs, std::max(lineBusyUntilUs_, measureStartUs_));
+        lineBusyUntilUs_ = std::max(lineBusyUntilUs_, it->endUs);
+        // half-duplex transceivers don't hear themselves; a receiver at another rate
+        // samples garbage with a framing error
+        for(size_t i = 0; i < devices_.size(); i++)
+        {
+            if(i == it->sender)
+                continue;
+            const bool garbled = devices_[i].baud != it->baud;
+            devices_[i].rx.push_back(garbled ? (uint8_t)~it->value : it->value);
+            devices_[i].rx.push_back(it->collided or garbled);
+        }
+        if(it->sender != master)
+        {
+            const bool garbled = lineBaud_ != it->baud;
+            masterReceive(garbled ? (uint8_t)~it->value : it->value, it->collided or garbled, it->endUs);
+        }
+        else if(--requestBytesLeft_ == 0 and active_)
+        {
+            requestEndUs_ = it->endUs;
+            deadlineUs_ = requestEndUs_ + current_.waitMs * 1000;
+        }
+        it = air_.erase(it);
+    }
+}
+
+void BusSimulator::exchange(uint64_t untilUs)
+{
+    std::vector<uint8_t> message;
+    for(Device& device : devices_)
+    {
+        if(device.fd < 0)
+            continue;
+        const StepHeader header{untilUs, (uint32_t)(device.rx.size() / 2)};
+        message.resize(sizeof(header));
+        std::memcpy(message.data(), &header, sizeof(header));
+        message.insert(message.end(), device.rx.begin(), device.rx.end());
+        device.rx.clear();
+        if(!sendAll(device.fd, message.data(), message.size()))
+        {
+            close(device.fd);
+            device.fd = -1;
+        }
+    }
+    std::vector<uint8_t> tx;
+    for(size_t i = 0; i < devices_.size(); i++)
+    {
+        Device& device = devices_[i];
+        uint32_t size = 0;
+        if(device.fd < 0)
+            continue;
+        tx.resize(0);
+        if(receiveAll(device.fd, &size, sizeof(size)))
+        {
+            tx.resize(size);
+            uint32_t baud = 0;
+            if((size == 0 or receiveAll(device.fd, tx.data(), size)) and receiveAll(device.fd, &baud, sizeof(baud)))
+            {
+                for(uint8_t value : tx)
+                    transmitters_[i].queue.emplace_back(value, untilUs);
+                device.baud = baud;
+                continue;
+            }
+        }
+        std::fprintf(stderr, "BusSimulator: device %lu stopped\n", (unsigned long)device.id);
+        close(device.fd);
+        device.fd = -1;
+    }
+}
+
+// Reply lines reach the master whole or not at all: a line with a framing error, or one that
+// isn't a status, counts as corrupt. A slotted reply names its vents, a board with several
+// polled axes answers for all of them in one array.
+void BusSimulator::masterReceive(uint8_t value, bool collided, uint64_t atUs)
+{
+    lineCorrupt_ = lineCorrupt_ or collided;
+    if(value != '\n')
+    {
+        line_ += (char)value;
+        return;
+    }
+    const bool corrupt = lineCorrupt_ or line_.find("\"state\":") == std::string::npos;
+    std::string line;
+    line.swap(line_);
+    lineCorrupt_ = false;
+    if(!active_ or requestEndUs_ == 0 or atUs > deadlineUs_)
+        return; // boot banners, late or stray replies
+    if(current_.expected.size() == 1)
+    {
+        answer(0, corrupt, atUs);
+        return;
+    }
+    bool attributed = false;
+    for(size_t key = line.find("\"id\":"); !corrupt and key != std::string::npos; key = line.find("\"id\":", key + 5))
+    {
+        const uint32_t id = (uint32_t)std::strtoul(line.c_str() + key + 5, nullptr, 10);
+        const auto found = std::find_if(current_.expected.begin(), current_.expected.end(), [&](size_t i) { return vents_[i].id == id; });
+        if(found == current_.expected.end())
+            continue;
+        answer((size_t)(found - current_.expected.begin()), false, atUs);
+        attributed = true;
+    }
+    if(!attributed and current_.measured)
+        unattributedCorrupt_++;
+}
+
+// slot is the position in current_.expected
+void BusSimulator::answer(size_t slot, bool corrupt, uint64_t atUs)
+{
+    if(answered_[slot])
+        return;
+    answered_[slot] = true;
+    Vent& vent = vents_[current_.expected[slot]];
+    if(!current_.measured)
+        return;
+    if(corrupt)
+    {
+        vent.report.corrupt++;
+        return;
+    }
+    vent.report.replies++;
+    vent.latenciesMs.push_back((atUs - requestEndUs_) / 1000.0);
+}
+
+void BusSimulator::masterSchedule()
+{
+    if(active_)
+    {
+        // without expected replies the frame waits out its waitMs, e.g. a rate switch
+        const bool complete = !answered_.empty() and std::all_of(answered_.begin(), answered_.end(), [](bool answered) { return answered; });
+        if(requestEndUs_ == 0 or (!complete and nowUs_ < deadlineUs_))
+            return;
+        finishTransaction();
+    }
+    if(nowUs_ >= nextMoveUs_ and nowUs_ < measureEndUs_)
+    {
+        // every vent to a new random opening, in as few multicast frames as fit
+        for(size_t first = 0; first < vents_.size(); first += kTargetsPerFrame)
+        {
+            Transaction move;
+            move.frame = "{\"targets\":[";
+            for(size_t i = first; i < std::min(vents_.size(), first + kTargetsPerFrame); i++)
+            {
+                random_ ^= random_ << 13; random_ ^= random_ >> 17; random_ ^= random_ << 5;
+                move.frame += (i > first ? ",[" : "[") + std::to_string(vents_[i].id) + "," + std::to_string(random_ % 101) + "]";
+            }
+            move.frame += "]}";
+            script_.push_front(move);
+        }
+        nextMoveUs_ += (uint64_t)(options_.moveEveryS * 1e6);
+    }
+    if(pollsQueued_ == 0 and nowUs_ >= nextCycleUs_ and nowUs_ < measureEndUs_)
+    {
+        if(nowUs_ >= nextCycleUs_ + options_.stepUs and measuring())
+            lateCycles_++;
+        const uint64_t periodUs = (uint64_t)(1e6 / options_.pollHz);
+        while(nextCycleUs_ <= nowUs_)
+            nextCycleUs_ += periodUs;
+        if(options_.mode == PollMode::Unicast)
+        {
+            for(size_t i = 0; i < vents_.size(); i++)
+            {
+                Transaction poll;
+                poll.frame = "{\"id\":" + std::to_string(vents_[i].id) + "}";
+                poll.expected = {i};
+                poll.waitMs = options_.replyTimeoutMs;
+                poll.poll = true;
+                script_.push_back(poll);
+            }
+            pollsQueued_ = vents_.size();
+        }
+        else
+        {
+            const unsigned long slotMs = (kStatusReplyMaxBytes * kBitsPerByte * 1000 + lineBaud_ - 1) / lineBaud_ + kSlotGapMs;
+            Transaction poll;
+            poll.frame = "{\"poll\":\"status\",\"slotMs\":" + std::to_string(slotMs) + "}";
+            for(size_t i = 0; i < vents_.size(); i++)
+                poll.expected.push_back(i);
+            poll.waitMs = kTurnaroundMs + vents_.size() * slotMs + options_.replyTimeoutMs;
+            poll.poll = true;
+            script_.push_back(poll);
+            pollsQueued_ = 1;
+        }
+    }
+    // listen before talk: never into a boot banner or a late reply
+    if(!script_.empty() and nowUs_ >= kPowerUpMs * 1000 and nowUs_ >= lineBusyUntilUs_ + kQuietMs * 1000)
+        startTransaction();
+}
+
+void BusSimulator::startTransaction()
+{
+    current_ = script_.front();
+    script_.pop_front();
+    current_.measured = current_.poll and measuring();
+    active_ = true;
+    requestEndUs_ = 0;
+    answered_.assign(current_.expected.size(), false);
+    if(current_.measured)
+    {
+        for(size_t i : current_.expected)
+            vents_[i].report.polls++;
+    }
+    const std::string frame = "FusionBusCommunicate " + current_.frame + "\n";
+    requestBytesLeft_ = frame.size();
+    for(char c : frame)
+        transmitters_.back().queue.emplace_back((uint8_t)c, nowUs_);
+}
+
+void BusSimulator::finishTransaction()
+{
+    if(current_.measured)
+    {
+        for(size_t slot = 0; slot < answered_.size(); slot++)
+            if(!answered_[slot]) vents_[current_.expected[slot]].report.timeouts++;
+    }
+    if(current_.poll)
+        pollsQueued_--;
+    if(current_.switchBaud)
+        lineBaud_ = current_.switchBaud; // the devices switched kBaudSettleMs ago
+    active_ = false;
+}
+
+std::string BusSimulator::Report::summary() const
+{
+    char line[160];
+    std::string out;
+    snprintf(line, sizeof(line), "%zu vents, %lu baud, %s polling at %.2f Hz, %.1f s simulated\n", devices.size(), baud,
+             mode == PollMode::Unicast ? "unicast" : "slotted", pollHz, simulatedS);
+    out += line;
+    snprintf(line, sizeof(line), "polls %zu, replies %zu, timeouts %zu, corrupt %zu, collisions %zu, late cycles %zu, line busy %.1f%%\n",
+             polls, replies, timeouts, corrupt, collisions, lateCycles, utilisation * 100);
+    out += line;
+    out += "        id  polls  replies  timeouts  corrupt   p50 ms   p90 ms   p99 ms   max ms    baud\n";
+    for(const DeviceReport& device : devices)
+    {
+        snprintf(line, sizeof(line), "%10lu %6zu %8zu %9zu %8zu %8.1f %8.1f %8.1f %8.1f %7lu\n", (unsigned long)device.id, device.polls,
+                 device.replies, device.timeouts, device.corrupt, device.p50Ms, device.p90Ms, device.p99Ms, device.maxMs, device.baud);
+        out += line;
+    }
+    return out;
+}
+
+BusSimulator::Options BusSimulator::fromEnvironment(Options options)
+{
+    if(const char* value = std::getenv("VENTSIM_DEVICES")) options.devices = std::strtoul(value, nullptr, 10);
+    if(const char* value = std::getenv("VENTSIM_BAUD")) options.baud = std::strtoul(value, nullptr, 10);
+    if(const char* value = std::getenv("VENTSIM_POLL_HZ")) options.pollHz = std::strtod(value, nullptr);
+    if(const char* value = std::getenv("VENTSIM_SECONDS")) options.measureS = std::strtod(value, nullptr);
+    if(const char* value = std::getenv("VENTSIM_SEED")) options.seed = std::strtoul(value, nullptr, 10);
+    if(const char* value = std::getenv("VENTSIM_MODE")) options.mode = std::strcmp(value, "slotted") == 0 ? PollMode::Slotted : PollMode::Unicast;
+    return options;
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Host-side FusionBus load test: N vents on one simulated half-duplex line, polled by a
+// scripted master. Every board is a full SystemFacade driving SystemFacade::kAxisCount vents
+// under consecutive ids, with a vent model behind the first axis' driver pins (STEP/DIR move
+// it, the endstop closes near home). The firmware and NativeHal keep their state in
+// singletons, so each board runs in a forked process that the simulator steps in lockstep;
+// the line itself, collisions included, is modelled here byte by byte.
+class BusSimulator
+{
+public:
+    enum class PollMode
+    {
+        Unicast, // {"id":..} to one device after the other, waiting for each reply
+        Slotted  // one {"poll":"status"}, every device answers in the slot assigned at start-up
+    };
+    struct Options
+    {
+        size_t devices = 8; // vents, on as many boards as that takes
+        uint32_t firstId = 1000;
+        unsigned long baud = 38400; // line rate; the devices boot at 38400, the warm-up negotiates any other
+        bool masterSwitches = true; // false: the master stays at 38400 after the baudSwitch, the devices must fall back
+        double pollHz = 2; // poll cycles per second, each covers every device once
+        PollMode mode = PollMode::Unicast;
+        unsigned long replyTimeoutMs = 100; // after the request, or after its slot when slotted
+        double warmupS = 3; // boot banners, homing and slot assignment, not measured
+        double measureS = 10;
+        double moveEveryS = 4; // a multicast "targets" frame moving every vent, 0 = never
+        unsigned long stepUs = 100; // lockstep resolution, also the devices' main loop period
+        uint32_t seed = 1;
+    };
+    struct DeviceReport // per vent, i.e. per axis id
+    {
+        uint32_t id = 0;
+        size_t polls = 0;
+        size_t replies = 0;
+        size_t timeouts = 0;
+        size_t corrupt = 0; // a line arrived but wasn't a readable status
+        double p50Ms = 0, p90Ms = 0, p99Ms = 0, maxMs = 0; // request end to reply end
+        unsigned long baud = 0; // its board's UART rate at the end
+    };
+    struct Report
+    {
+        std::vector<DeviceReport> devices;
+        size_t polls = 0;
+        size_t replies = 0;
+        size_t timeouts = 0;
+        size_t corrupt = 0;
+        size_t collisions = 0; // bytes sent while another node drove the line
+        size_t lateCycles = 0; // poll cycles that started late, the previous one was still running
+        double utilisation = 0; // share of the measured time the line carried a byte
+        double simulatedS = 0;
+        unsigned long baud = 0; // the master's line rate at the end
+        PollMode mode = PollMode::Unicast;
+        double pollHz = 0;
+        std::string summary() const;
+    };
+
+    explicit BusSimulator(const Options& options);
+    ~BusSimulator();
+    BusSimulator(const BusSimulator&) = delete;
+    BusSimulator& operator=(const BusSimulator&) = delete;
+
+    Report run();
+    // VENTSIM_DEVICES, VENTSIM_BAUD, VENTSIM_POLL_HZ, VENTSIM_MODE (unicast|slotted),
+    // VENTSIM_SECONDS and VENTSIM_SEED override the given options
+    static Options fromEnvironment(Options options);
+
+private:
+    struct AirByte
+    {
+        uint64_t startUs;
+        uint64_t endUs;
+        size_t sender; // device index, devices_.size() is the master
+        uint8_t value;
+        bool collided;
+        unsigned long baud; // the sender's rate
+    };
+    struct Transmitter
+    {
+        std::deque<std::pair<uint8_t, uint64_t>> queue; // byte, time it was handed to the UART
+        uint64_t busyUntilUs = 0;
+    };
+    struct Device // a board
+    {
+        uint32_t id = 0; // of its first axis
+        int pid = -1;
+        int fd = -1; // socket to the device process
+        unsigned long baud = 0; // its UART rate, reported every step
+        std::vector<uint8_t> rx; // value, flags pairs for the next step
+    };
+    struct Vent
+    {
+        size_t device = 0; // index of its board
+        uint32_t id = 0;
+        std::vector<double> latenciesMs;
+        DeviceReport report;
+    };
+    struct Transaction
+    {
+        std::string frame;
+        std::vector<size_t> expected; // vent indexes that owe a reply
+        bool poll = false;
+        bool measured = false; // a poll started inside the measured window
+        unsigned long waitMs = 0; // reply window after the request
+        unsigned long switchBaud = 0; // the master's new line rate once the window ends, 0 = keep
+    };
+
+    void spawn(Device& device, long startStep);
+    static void deviceMain(int fd, uint32_t id, long startStep);
+    void step();
+    void scheduleBytes(uint64_t untilUs);
+    void deliverBytes(uint64_t untilUs);
+    void exchange(uint64_t untilUs);
+    void masterReceive(uint8_t value, bool collided, uint64_t atUs);
+    void answer(size_t slot, bool corrupt, uint64_t atUs);
+    void masterSchedule();
+    void startTransaction();
+    void finishTransaction();
+    bool measuring() const { return nowUs_ >= measureStartUs_ and nowUs_ < measureEndUs_; }
+
+    Options options_;
+    std::vector<Device> devices_;
+    std::vector<Vent> vents_;
+    std::vector<Transmitter> transmitters_; // one per device, the master last
+    std::deque<AirByte> air_;
+    uint64_t nowUs_ = 0;
+    unsigned long lineBaud_ = 38400; // the master's rate
+    uint64_t measureStartUs_ = 0;
+    uint64_t measureEndUs_ = 0;
+    uint64_t lineBusyUntilUs_ = 0;
+    uint64_t busyUs_ = 0;
+    size_t collisions_ = 0;
+    size_t lateCycles_ = 0;
+    size_t unattributedCorrupt_ = 0; // slotted replies too garbled to tell who sent them
+    // scripted master
+    std::deque<Transaction> script_;
+    bool active_ = false;
+    Transaction current_;
+    size_t requestBytesLeft_ = 0;
+    uint64_t requestEndUs_ = 0; // last byte of the current request off the line, 0 = still sending
+    uint64_t deadlineUs_ = 0;
+    std::vector<bool> answered_;
+    std::string line_;
+    bool lineCorrupt_ = false;
+    size_t pollsQueued_ = 0; // polls of the running cycle not finished yet
+    uint64_t nextCycleUs_ = 0;
+    uint64_t nextMoveUs_ = 0;
+    uint32_t random_ = 1;
+};
@@ -0,0 +1,114 @@
+// FusionBus load tests on the simulated line: run with `pio test -e native -f test_bus_sim -v`
+// for the reports. load_test takes its setup from VENTSIM_* environment variables (see
+// BusSimulator::fromEnvironment), e.g. VENTSIM_DEVICES=24 VENTSIM_POLL_HZ=1 VENTSIM_MODE=slotted.
+#include <unity.h>
+#include "BusSimulator.hpp"
+
+namespace
+{
+    BusSimulator::Report simulate(const BusSimulator::Options& options)
+    {
+        BusSimulator simulator(options);
+        const BusSimulator::Report report = simulator.run();
+        TEST_MESSAGE(report.summary().c_str());
+        return report;
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+// every poll is accounted for, whatever the load
+void load_test()
+{
+    const BusSimulator::Report report = simulate(BusSimulator::fromEnvironment(BusSimulator::Options()));
+    TEST_ASSERT_EQUAL_INT(report.polls, report.replies + report.timeouts + report.corrupt);
+    TEST_ASSERT_GREATER_THAN(0, report.polls);
+}
+
+// one master polling in turn keeps the line free of collisions, and 8 vents at 2 Hz fit
+void unicast_within_capacity()
+{
+    BusSimulator::Options options;
+    options.devices = 8;
+    options.pollHz = 2;
+    const BusSimulator::Report report = simulate(options);
+    TEST_ASSERT_EQUAL_INT(0, report.timeouts);
+    TEST_ASSERT_EQUAL_INT(0, report.collisions);
+    TEST_ASSERT_EQUAL_INT(0, report.lateCycles);
+    TEST_ASSERT_EQUAL_INT(report.polls, report.replies);
+}
+
+// each reply costs a turnaround guard plus its bytes, so unicast polling runs out of time
+// long before the line is full: the cycles start late, but nothing times out
+void unicast_saturates()
+{
+    BusSimulator::Options options;
+    options.devices = 16;
+    options.pollHz = 4;
+    options.measureS = 5;
+    const BusSimulator::Report report = simulate(options);
+    TEST_ASSERT_GREATER_THAN(0, report.lateCycles);
+    TEST_ASSERT_EQUAL_INT(0, report.timeouts);
+}
+
+// slotted replies follow each other without collisions, one request serves every vent
+void slotted_within_capacity()
+{
+    BusSimulator::Options options;
+    options.devices = 16;
+    options.pollHz = 1;
+    options.mode = BusSimulator::PollMode::Slotted;
+    const BusSimulator::Report report = simulate(options);
+    TEST_ASSERT_EQUAL_INT(0, report.timeouts);
+    TEST_ASSERT_EQUAL_INT(0, report.collisions);
+    TEST_ASSERT_EQUAL_INT(report.polls, report.replies);
+}
+
+// negotiated up to 230400 baud the slots shrink with the byte time: 16 vents polled at 4 Hz,
+// a cycle 38400 baud can't fit in 250 ms
+void negotiated_rate_speeds_up_slotted()
+{
+    BusSimulator::Options options;
+    options.devices = 16;
+    options.pollHz = 4;
+    options.mode = BusSimulator::PollMode::Slotted;
+    options.baud = 230400;
+    options.measureS = 5;
+    const BusSimulator::Report report = simulate(options);
+    TEST_ASSERT_EQUAL_INT(0, report.timeouts);
+    TEST_ASSERT_EQUAL_INT(0, report.collisions);
+    TEST_ASSERT_EQUAL_INT(0, report.lateCycles);
+    TEST_ASSERT_EQUAL_INT(report.polls, report.replies);
+    for(const BusSimulator::DeviceReport& device : report.devices)
+        TEST_ASSERT_EQUAL_UINT32(230400, device.baud);
+}
+
+// the master never follows its baudSwitch: unconfirmed, the devices return to 38400 on
+// their own and answer there
+void unconfirmed_rate_falls_back()
+{
+    BusSimulator::Options options;
+    options.devices = 4;
+    options.baud = 230400;
+    options.masterSwitches = false;
+    options.warmupS = 5; // past the devices' probation
+    options.measureS = 3;
+    const BusSimulator::Report report = simulate(options);
+    TEST_ASSERT_EQUAL_INT(0, report.timeouts);
+    TEST_ASSERT_EQUAL_INT(report.polls, report.replies);
+    for(const BusSimulator::DeviceReport& device : report.devices)
+        TEST_ASSERT_EQUAL_UINT32(38400, device.baud);
+}
+
+int main(int argc, char** argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(load_test);
+    RUN_TEST(unicast_within_capacity);
+    RUN_TEST(unicast_saturates);
+    RUN_TEST(slotted_within_capacity);
+    RUN_TEST(negotiated_rate_speeds_up_slotted);
+    RUN_TEST(unconfirmed_rate_falls_back);
+    return UNITY_END();
+}
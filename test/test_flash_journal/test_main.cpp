@@ -0,0 +1,174 @@
+// FlashJournal on NativeHal's flash: `pio test -e native -f test_flash_journal`
+#include <unity.h>
+#include <cstring>
+#include "NativeHal.h"
+#include "FlashJournal.hpp"
+
+namespace
+{
+    struct __attribute__((packed)) Sample
+    {
+        uint32_t value;
+        uint16_t tag;
+    };
+
+    constexpr uintptr_t kFirstPage = 60 * 1024; // offset into the 64 KB part, as SystemFacade uses it
+    using Journal = FlashJournal<Sample, 1>;
+    constexpr size_t kSlotsPerPage = FLASH_PAGE_SIZE / Journal::slotSize();
+
+    uintptr_t firstPage()
+    {
+        return FLASH_BASE + kFirstPage;
+    }
+
+    uint8_t* slot(uint32_t page, size_t index)
+    {
+        return reinterpret_cast<uint8_t*>(firstPage() + page * FLASH_PAGE_SIZE + index * Journal::slotSize());
+    }
+
+    // a fresh instance, as after a reboot
+    bool reload(Sample& sample)
+    {
+        Journal journal(firstPage());
+        return journal.load(sample);
+    }
+}
+
+void setUp()
+{
+    NativeHal::reset();
+    NativeHal::eraseFlash();
+}
+
+void tearDown() {}
+
+void empty_flash_loads_nothing()
+{
+    Sample sample{7, 7};
+    TEST_ASSERT_FALSE(reload(sample));
+    TEST_ASSERT_EQUAL_UINT32(7, sample.value); // untouched
+}
+
+// records fill page 0, then page 1 is erased and takes over, then page 0 again; every
+// reboot on the way finds the newest record and carries on after it
+void store_across_page_fills()
+{
+    static_assert(Journal::slotSize() == 16, "Entry layout: magic, version, sequence, 6-byte record, crc");
+    const size_t stores = 3 * kSlotsPerPage + 5;
+    for(size_t i = 0; i < stores; i++)
+    {
+        Journal journal(firstPage());
+        Sample loaded;
+        TEST_ASSERT_EQUAL(i > 0, journal.load(loaded));
+        if(i > 0)
+            TEST_ASSERT_EQUAL_UINT32(i - 1, loaded.value);
+        TEST_ASSERT_TRUE(journal.store(Sample{(uint32_t)i, 0xA5}));
+    }
+    Sample loaded;
+    TEST_ASSERT_TRUE(reload(loaded));
+    TEST_ASSERT_EQUAL_UINT32(stores - 1, loaded.value);
+    TEST_ASSERT_EQUAL_UINT32(0xA5, loaded.tag);
+    TEST_ASSERT_EQUAL_UINT32(3, NativeHal::flashEraseCount()); // page 1, page 0, page 1; the blank page 0 needed none
+}
+
+// an unchanged record is not written again
+void store_skips_unchanged()
+{
+    Journal journal(firstPage());
+    Sample loaded;
+    journal.load(loaded);
+    TEST_ASSERT_TRUE(journal.store(Sample{1, 2}));
+    TEST_ASSERT_TRUE(journal.store(Sample{1, 2}));
+    TEST_ASSERT_EQUAL_UINT8(0xFF, slot(0, 1)[0]);
+    TEST_ASSERT_TRUE(journal.store(Sample{1, 3}));
+    TEST_ASSERT_TRUE(slot(0, 1)[0] != 0xFF);
+}
+
+// a record with a bad CRC, e.g. one torn by a reset while programming, is skipped and the
+// one before it wins; the next store goes past the damaged slot
+void crc_rejects_damaged_record()
+{
+    {
+        Journal journal(firstPage());
+        Sample loaded;
+        journal.load(loaded);
+        journal.store(Sample{10, 0});
+        journal.store(Sample{11, 0});
+    }
+    slot(0, 1)[8] ^= 0x01; // inside the record
+    Sample loaded;
+    TEST_ASSERT_TRUE(reload(loaded));
+    TEST_ASSERT_EQUAL_UINT32(10, loaded.value);
+
+    std::memset(slot(0, 1), 0xFF, Journal::slotSize()); // torn: only the first halfwords made it
+    std::memcpy(slot(0, 1), slot(0, 0), 4);
+    TEST_ASSERT_TRUE(reload(loaded));
+    TEST_ASSERT_EQUAL_UINT32(10, loaded.value);
+
+    Journal journal(firstPage());
+    journal.load(loaded);
+    TEST_ASSERT_TRUE(journal.store(Sample{12, 0}));
+    TEST_ASSERT_TRUE(reload(loaded));
+    TEST_ASSERT_EQUAL_UINT32(12, loaded.value);
+    TEST_ASSERT_EQUAL_UINT32(0, NativeHal::flashEraseCount());
+}
+
+// records of another format version are ignored, and the new format takes the pages over
+void version_rejects_other_format()
+{
+    {
+        Journal journal(firstPage());
+        Sample loaded;
+        journal.load(loaded);
+        journal.store(Sample{20, 0});
+    }
+    FlashJournal<Sample, 2> upgraded(firstPage());
+    Sample loaded;
+    TEST_ASSERT_FALSE(upgraded.load(loaded));
+    TEST_ASSERT_TRUE(upgraded.store(Sample{21, 0}));
+    TEST_ASSERT_TRUE(upgraded.load(loaded));
+    TEST_ASSERT_EQUAL_UINT32(21, loaded.value);
+    TEST_ASSERT_TRUE(reload(loaded)); // the old build still finds its own record
+    TEST_ASSERT_EQUAL_UINT32(20, loaded.value);
+}
+
+// a mark voids part of the newest record in place, without an erase; the next store writes
+// a fresh record even if it is equal, with its marks erased
+void marks_void_in_place()
+{
+    using Marked = FlashJournal<Sample, 1, 2>;
+    {
+        Marked journal(firstPage());
+        Sample loaded;
+        journal.load(loaded);
+        TEST_ASSERT_FALSE(journal.mark(0)); // nothing stored yet
+        TEST_ASSERT_TRUE(journal.store(Sample{30, 0}));
+        TEST_ASSERT_TRUE(journal.mark(1));
+        TEST_ASSERT_TRUE(journal.marked(1));
+        TEST_ASSERT_FALSE(journal.marked(0));
+    }
+    Marked journal(firstPage());
+    Sample loaded;
+    TEST_ASSERT_TRUE(journal.load(loaded)); // the record itself stays valid
+    TEST_ASSERT_EQUAL_UINT32(30, loaded.value);
+    TEST_ASSERT_TRUE(journal.marked(1));
+    TEST_ASSERT_TRUE(journal.store(Sample{30, 0}));
+    TEST_ASSERT_FALSE(journal.marked(1));
+
+    Marked rebooted(firstPage());
+    TEST_ASSERT_TRUE(rebooted.load(loaded));
+    TEST_ASSERT_FALSE(rebooted.marked(0) or rebooted.marked(1));
+    TEST_ASSERT_EQUAL_UINT32(0, NativeHal::flashEraseCount());
+}
+
+int main(int argc, char** argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(empty_flash_loads_nothing);
+    RUN_TEST(store_across_page_fills);
+    RUN_TEST(store_skips_unchanged);
+    RUN_TEST(crc_rejects_damaged_record);
+    RUN_TEST(version_rejects_other_format);
+    RUN_TEST(marks_void_in_place);
+    return UNITY_END();
+}
@@ -0,0 +1,239 @@
+// FusionBus protocol and command replies through SystemFacade: `pio test -e native -f test_fusionbus`
+#include <unity.h>
+#include <cstring>
+#include <string>
+#include <Encoding/COBS.h>
+#include "NativeHal.h"
+#include "SystemFacade.hpp"
+
+namespace
+{
+    constexpr uint32_t kDeviceId = 42;
+    constexpr uint32_t kForeignId = 1000; // past the ids of every axis
+    constexpr unsigned long kTurnaroundUs = 10000; // FusionBusSlave::Timeouts::turnaroundGuardMs
+
+    std::string textFrame(uint32_t id, const std::string& rest)
+    {
+        return "FusionBusCommunicate {\"id\":" + std::to_string(id) + rest + "}\n";
+    }
+
+    // delimiter, COBS(command + CRC16), delimiter
+    std::string binaryFrame(uint32_t id, uint8_t flags, uint8_t ventingPercent)
+    {
+        const FusionBusBinary::Command command{FusionBusBinary::kVersion, (uint8_t)FusionBusBinary::Opcode::Command, id, flags, ventingPercent};
+        uint8_t raw[sizeof(command) + 2];
+        std::memcpy(raw, &command, sizeof(command));
+        const uint16_t crc = FusionBusBinary::crc16(raw, sizeof(command));
+        raw[sizeof(command)] = (uint8_t)(crc & 0xFF);
+        raw[sizeof(command) + 1] = (uint8_t)(crc >> 8);
+        uint8_t encoded[sizeof(raw) + 2];
+        const size_t size = COBS::encode(raw, sizeof(raw), encoded);
+        return std::string(1, '\0') + std::string((const char*)encoded, size) + std::string(1, '\0');
+    }
+
+    // the request, the turnaround guard, the reply
+    std::string exchange(SystemFacade& system, const std::string& request)
+    {
+        NativeHal::serialInject(USART1, request);
+        system.loop();
+        NativeHal::advanceMicros(kTurnaroundUs);
+        system.loop(); // guard time over, the reply is queued
+        system.loop(); // TX complete, back to Idle
+        return NativeHal::serialTakeOutput(USART1);
+    }
+
+    // decodes a delimited binary reply into status, false if it isn't one
+    bool decodeStatus(const std::string& reply, FusionBusBinary::Status& status)
+    {
+        if(reply.size() < 3 or reply.front() != '\0' or reply.back() != '\0')
+            return false;
+        uint8_t decoded[64];
+        const size_t size = COBS::decode((const uint8_t*)reply.data() + 1, reply.size() - 2, decoded);
+        if(size != sizeof(status) + 2 or FusionBusBinary::crc16(decoded, sizeof(status)) != (uint16_t)(decoded[size - 2] | decoded[size - 1] << 8))
+            return false;
+        std::memcpy(&status, decoded, sizeof(status));
+        return true;
+    }
+
+    void enterBinaryMode(SystemFacade& system)
+    {
+        system.begin();
+        NativeHal::serialTakeOutput(USART1); // banner
+        const std::string reply = exchange(system, textFrame(kDeviceId, ",\"binary\":true"));
+        TEST_ASSERT_TRUE(reply.find("\"state\"") != std::string::npos); // the switch is answered in text
+    }
+}
+
+void setUp()
+{
+    NativeHal::reset();
+    NativeHal::eraseFlash();
+}
+
+void tearDown() {}
+
+// a binary command after the switch is answered with a binary status for our id
+void binary_round_trip()
+{
+    SystemFacade system(kDeviceId);
+    enterBinaryMode(system);
+
+    FusionBusBinary::Status status;
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, binaryFrame(kDeviceId, 0, 0)), status));
+    TEST_ASSERT_EQUAL_UINT32(kDeviceId, status.id);
+    TEST_ASSERT_EQUAL_UINT8((uint8_t)FusionBusBinary::Opcode::Status, status.opcode);
+    TEST_ASSERT_TRUE(exchange(system, binaryFrame(kForeignId, 0, 0)).empty()); // another id stays quiet
+}
+
+// text frames for other devices and stray text must not end up in the binary frame
+void binary_after_text_traffic()
+{
+    SystemFacade system(kDeviceId);
+    enterBinaryMode(system);
+
+    TEST_ASSERT_TRUE(exchange(system, textFrame(kForeignId, ",\"ventingPercent\":40")).empty());
+    FusionBusBinary::Status status;
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, binaryFrame(kDeviceId, 0, 0)), status));
+
+    const std::string mixed = textFrame(kForeignId, ",\"pad\":\"" + std::string(100, 'x') + "\"") + binaryFrame(kDeviceId, 0, 0);
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, mixed), status));
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, "line noise\n" + binaryFrame(kDeviceId, 0, 0)), status));
+}
+
+// a text request still works in binary mode, and kTextMode switches back after the binary reply
+void binary_text_fallback()
+{
+    SystemFacade system(kDeviceId);
+    enterBinaryMode(system);
+
+    TEST_ASSERT_TRUE(exchange(system, textFrame(kDeviceId, "")).find("\"state\"") != std::string::npos);
+    FusionBusBinary::Status status;
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, binaryFrame(kDeviceId, FusionBusBinary::kTextMode, 0)), status));
+    TEST_ASSERT_TRUE(exchange(system, binaryFrame(kDeviceId, 0, 0)).empty());
+}
+
+// after a rate switch, binary polling alone confirms the new rate
+void binary_frame_confirms_rate()
+{
+    SystemFacade system(kDeviceId);
+    enterBinaryMode(system);
+
+    TEST_ASSERT_TRUE(exchange(system, textFrame(kDeviceId, ",\"baud\":115200")).find("\"ack\":true") != std::string::npos);
+    NativeHal::serialInject(USART1, "FusionBusCommunicate {\"baudSwitch\":115200,\"inMs\":0}\n");
+    system.loop();
+    TEST_ASSERT_EQUAL_UINT32(115200, NativeHal::serialBaud(USART1));
+    NativeHal::serialTakeOutput(USART1);
+
+    FusionBusBinary::Status status;
+    TEST_ASSERT_TRUE(decodeStatus(exchange(system, binaryFrame(kDeviceId, 0, 0)), status));
+    NativeHal::advanceMicros(5000000); // past the probation
+    system.loop();
+    TEST_ASSERT_EQUAL_UINT32(115200, NativeHal::serialBaud(USART1));
+}
+
+// a flipped bit fails the CRC and counts as corrupt, the next frame goes through; text
+// traffic in between is no binary frame at all
+void binary_corrupt_frame()
+{
+    FusionBusSlave fusionBus("Ventdrive");
+    fusionBus.onCommunicate([](std::string_view, FusionBusSlave::Response&) { return false; });
+    fusionBus.onBinary([](const uint8_t*, size_t, FusionBusSlave::Response& response) { return response.assign("ok", 2); });
+    fusionBus.begin(38400);
+    fusionBus.setBinaryMode(true);
+    NativeHal::serialTakeOutput(USART1);
+
+    NativeHal::serialInject(USART1, textFrame(kForeignId, ",\"ventingPercent\":40") + std::string(1, '\0'));
+    fusionBus.loop();
+    TEST_ASSERT_EQUAL_UINT32(0, fusionBus.corruptFrames());
+
+    std::string corrupt = binaryFrame(kDeviceId, 0, 0);
+    corrupt[3] ^= 0x10; // a payload byte, still nonzero
+    NativeHal::serialInject(USART1, corrupt);
+    fusionBus.loop();
+    TEST_ASSERT_EQUAL_UINT32(1, fusionBus.corruptFrames());
+
+    NativeHal::serialInject(USART1, binaryFrame(kDeviceId, 0, 0));
+    fusionBus.loop();
+    NativeHal::advanceMicros(kTurnaroundUs);
+    fusionBus.loop();
+    TEST_ASSERT_FALSE(NativeHal::serialTakeOutput(USART1).empty());
+    TEST_ASSERT_EQUAL_UINT32(1, fusionBus.corruptFrames());
+}
+
+// a request right behind our reply is answered: only the reply's own echo is dropped, even
+// before the main loop has seen TX-complete
+void request_right_after_reply()
+{
+    SystemFacade system(kDeviceId);
+    system.begin();
+    NativeHal::serialTakeOutput(USART1);
+
+    NativeHal::serialInject(USART1, textFrame(kDeviceId, ""));
+    system.loop();
+    NativeHal::advanceMicros(kTurnaroundUs);
+    USART1->SR &= ~USART_SR_TC; // the reply is still on the line
+    system.loop(); // the reply is queued, its echo waits in the receive buffer
+    TEST_ASSERT_FALSE(NativeHal::serialTakeOutput(USART1).empty());
+    NativeHal::serialInject(USART1, textFrame(kDeviceId, ""));
+    system.loop();
+    USART1->SR |= USART_SR_TC;
+    NativeHal::advanceMicros(kTurnaroundUs);
+    system.loop();
+    TEST_ASSERT_TRUE(NativeHal::serialTakeOutput(USART1).find("\"state\"") != std::string::npos);
+}
+
+// a schedule is acknowledged in the status reply; points out of order or past the period
+// are rejected and the running schedule stays
+void schedule_acknowledged()
+{
+    SystemFacade system(kDeviceId);
+    system.begin();
+    NativeHal::serialTakeOutput(USART1);
+
+    std::string reply = exchange(system, textFrame(kDeviceId, ",\"schedule\":{\"points\":[[0,40],[3600,80]],\"period\":86400,\"now\":0}"));
+    TEST_ASSERT_TRUE(reply.find("\"schedule\":true}") != std::string::npos);
+    reply = exchange(system, textFrame(kDeviceId, ",\"schedule\":{\"points\":[[3600,40],[0,80]]}"));
+    TEST_ASSERT_TRUE(reply.find("\"schedule\":false}") != std::string::npos);
+    reply = exchange(system, textFrame(kDeviceId, ",\"schedule\":{\"points\":[[0,40],[90000,80]],\"period\":86400}"));
+    TEST_ASSERT_TRUE(reply.find("\"schedule\":false}") != std::string::npos);
+    reply = exchange(system, textFrame(kDeviceId, ",\"schedule\":null"));
+    TEST_ASSERT_TRUE(reply.find("\"schedule\":true}") != std::string::npos);
+    reply = exchange(system, textFrame(kDeviceId, ""));
+    TEST_ASSERT_TRUE(reply.find("\"state\"") != std::string::npos);
+    TEST_ASSERT_TRUE(reply.find("schedule") == std::string::npos); // only answered when one was sent
+}
+
+// with a slot for every axis, the board answers a poll once, in its first slot, with every
+// axis in the reply; the four-axis build is the largest reply: `pio test -e native_axes4`
+void polled_status_all_axes()
+{
+    SystemFacade system(kDeviceId);
+    system.begin();
+    NativeHal::serialTakeOutput(USART1);
+    for(uint32_t i = 0; i < SystemFacade::kAxisCount; i++)
+        TEST_ASSERT_FALSE(exchange(system, textFrame(kDeviceId + i, ",\"slot\":" + std::to_string(i))).empty());
+
+    const std::string reply = exchange(system, "FusionBusCommunicate {\"poll\":\"status\"}\n");
+    TEST_ASSERT_TRUE(reply.size() > 2 and reply.compare(reply.size() - 2, 2, "\r\n") == 0);
+    TEST_ASSERT_EQUAL(SystemFacade::kAxisCount > 1, reply.front() == '[');
+    size_t from = 0;
+    for(uint32_t i = 0; i < SystemFacade::kAxisCount; i++)
+    {
+        from = reply.find("{\"id\":" + std::to_string(kDeviceId + i) + ",", from);
+        TEST_ASSERT_TRUE(from != std::string::npos);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(binary_round_trip);
+    RUN_TEST(binary_after_text_traffic);
+    RUN_TEST(binary_text_fallback);
+    RUN_TEST(binary_frame_confirms_rate);
+    RUN_TEST(binary_corrupt_frame);
+    RUN_TEST(request_right_after_reply);
+    RUN_TEST(schedule_acknowledged);
+    RUN_TEST(polled_status_all_axes);
+    return UNITY_END();
+}
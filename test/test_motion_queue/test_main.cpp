@@ -0,0 +1,182 @@
+// Motion segment queue and step timing on the virtual clock: `pio test -e native -f test_motion_queue`.
+// The StepScheduler interrupt runs as NativeHal's TIM3 fires, the main loop once a millisecond.
+#include <unity.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "NativeHal.h"
+#include "MotionVisor.hpp"
+
+namespace
+{
+    constexpr unsigned long kMoveTimeoutMs = 10000; // a full stroke at the default config takes ~4 s
+    constexpr long kStepsPerPercent = 60; // default config: 30 mm at 200 steps/mm
+    constexpr unsigned long kHoldPollMs = 10; // MotionVisor::kHoldPollQ
+
+    // one main loop pass per millisecond until done() or the timeout, false on timeout
+    bool runUntil(MotionVisor& motionVisor, const std::function<bool()>& done, unsigned long timeoutMs = kMoveTimeoutMs)
+    {
+        for(unsigned long ms = 0; ms < timeoutMs; ms++)
+        {
+            if(done())
+                return true;
+            NativeHal::runFor(1000);
+            motionVisor.loop();
+        }
+        return done();
+    }
+
+    void run(MotionVisor& motionVisor, unsigned long ms)
+    {
+        runUntil(motionVisor, [] { return false; }, ms);
+    }
+
+    bool idleAt(MotionVisor& motionVisor, int percent)
+    {
+        return motionVisor.state() == MotionVisorState::Idle and motionVisor.ventingPercent() == percent;
+    }
+
+    // homes against a pressed endstop (inverted input), then releases it for the moves
+    void home(MotionVisor& motionVisor)
+    {
+        TEST_ASSERT_TRUE(motionVisor.begin());
+        NativeHal::setPin(PB1, LOW);
+        motionVisor.autoHome();
+        run(motionVisor, 200);
+        NativeHal::setPin(PB1, HIGH);
+        TEST_ASSERT_TRUE(idleAt(motionVisor, 0));
+    }
+
+    // the steps the vent stopped or turned at, in order, until it came to rest with the queue empty
+    std::vector<long> stops(MotionVisor& motionVisor)
+    {
+        std::vector<long> at;
+        MotionVisorState travel = MotionVisorState::Idle;
+        long extreme = 0;
+        runUntil(motionVisor, [&]
+        {
+            const MotionVisorState state = motionVisor.state();
+            const long step = motionVisor.position().value_or(-1);
+            if(state != travel and travel != MotionVisorState::Idle)
+                at.push_back(extreme);
+            if(state != travel)
+                extreme = step;
+            extreme = state == MotionVisorState::Opening ? std::max(extreme, step) : std::min(extreme, step);
+            travel = state;
+            return state == MotionVisorState::Idle and motionVisor.queuedSegments() == 0 and !at.empty();
+        });
+        return at;
+    }
+}
+
+// NativeHal::reset() would clear TIM3, which the StepScheduler singleton sets up only once;
+// the clock runs on across the tests instead
+void setUp() {}
+
+void tearDown() {}
+
+// segments without a hold in the same direction blend: the vent passes them without stopping
+void blends_onward_segments()
+{
+    MotionVisor motionVisor;
+    home(motionVisor);
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(40));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(60));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(80));
+    const std::vector<long> at = stops(motionVisor);
+    TEST_ASSERT_EQUAL_size_t(1, at.size());
+    TEST_ASSERT_EQUAL_INT(80 * kStepsPerPercent, at[0]);
+}
+
+// a reversal can't blend: the vent brakes to a stop at the turning point and goes back
+void stops_at_reversal()
+{
+    MotionVisor motionVisor;
+    home(motionVisor);
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(80));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(50));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(90));
+    const std::vector<long> at = stops(motionVisor);
+    TEST_ASSERT_EQUAL_size_t(3, at.size());
+    TEST_ASSERT_EQUAL_INT(80 * kStepsPerPercent, at[0]);
+    TEST_ASSERT_EQUAL_INT(50 * kStepsPerPercent, at[1]);
+    TEST_ASSERT_EQUAL_INT(90 * kStepsPerPercent, at[2]);
+}
+
+// a hold starts once the vent stands still at the previous goal and lasts holdMs; the
+// interrupt checks a held segment every kHoldPollMs, and notices the standstill on one of those
+void holds_before_segment()
+{
+    constexpr uint32_t kHoldMs = 500;
+    MotionVisor motionVisor;
+    home(motionVisor);
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(50));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(70, kHoldMs));
+    TEST_ASSERT_TRUE(runUntil(motionVisor, [&] { return idleAt(motionVisor, 50); }));
+    const unsigned long arrivedMs = millis();
+    TEST_ASSERT_TRUE(runUntil(motionVisor, [&] { return motionVisor.state() == MotionVisorState::Opening; }));
+    const unsigned long heldMs = millis() - arrivedMs;
+    TEST_ASSERT_TRUE(heldMs >= kHoldMs and heldMs <= kHoldMs + 2 * kHoldPollMs);
+    TEST_ASSERT_TRUE(runUntil(motionVisor, [&] { return idleAt(motionVisor, 70); }));
+}
+
+// a direct setpoint drops everything queued, also a segment waiting out its hold
+void setpoint_flushes_queue()
+{
+    MotionVisor motionVisor;
+    home(motionVisor);
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(60));
+    TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(100, 1000));
+    TEST_ASSERT_TRUE(runUntil(motionVisor, [&] { return idleAt(motionVisor, 60); }));
+    motionVisor.setVentingPercent(40);
+    TEST_ASSERT_EQUAL_size_t(0, motionVisor.queuedSegments());
+    TEST_ASSERT_TRUE(runUntil(motionVisor, [&] { return idleAt(motionVisor, 40); }));
+    run(motionVisor, 2000); // past the dropped hold
+    TEST_ASSERT_TRUE(idleAt(motionVisor, 40));
+}
+
+// the queue takes kQueueDepth segments, and none before homing
+void queue_limits()
+{
+    {
+        MotionVisor unhomed;
+        TEST_ASSERT_TRUE(unhomed.begin());
+        TEST_ASSERT_FALSE(unhomed.queueVentingPercent(50));
+    }
+    MotionVisor motionVisor;
+    home(motionVisor);
+    for(size_t i = 0; i < MotionVisor::kQueueDepth; i++)
+        TEST_ASSERT_TRUE(motionVisor.queueVentingPercent(i % 2 ? 40 : 60, 1000));
+    TEST_ASSERT_FALSE(motionVisor.queueVentingPercent(80));
+    TEST_ASSERT_EQUAL_size_t(MotionVisor::kQueueDepth, motionVisor.queuedSegments());
+}
+
+// a step delay longer than a 16-bit timer period (65 ms at MOTIONVISOR_HW_STEP's 1us count) is kept
+void slow_steps_keep_their_delay()
+{
+    constexpr unsigned long kStepMs = 100;
+    constexpr unsigned long kRunMs = 2000;
+    MotionVisor motionVisor;
+    home(motionVisor);
+    MotionVisorConfig config = motionVisor.getConfig();
+    config.speed = 1000.0 / kStepMs / config.stepPermm; // mm/s
+    config.acceleration = 0; // cruise from the first step
+    motionVisor.setConfig(config);
+    motionVisor.setVentingPercent(50);
+    run(motionVisor, kRunMs);
+    const long steps = motionVisor.position().value_or(0);
+    TEST_ASSERT_TRUE(steps >= (long)(kRunMs / kStepMs) - 1 and steps <= (long)(kRunMs / kStepMs) + 1);
+}
+
+int main(int argc, char** argv)
+{
+    NativeHal::reset();
+    UNITY_BEGIN();
+    RUN_TEST(blends_onward_segments);
+    RUN_TEST(stops_at_reversal);
+    RUN_TEST(holds_before_segment);
+    RUN_TEST(setpoint_flushes_queue);
+    RUN_TEST(queue_limits);
+    RUN_TEST(slow_steps_keep_their_delay);
+    return UNITY_END();
+}
@@ -0,0 +1,215 @@
+#include "FusionBusReplay.hpp"
+#include "NativeHal.h"
+#include "FusionBusSlave.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+namespace
+{
+    constexpr unsigned long kBaud = 38400; // SystemFacade's bus rate, the fuzz traffic follows it
+    constexpr double kByteUs = 10 * 1e6 / kBaud; // 8N1
+    constexpr unsigned long kSettleMs = 1000; // past every Timeouts entry, longer gaps are skipped
+    constexpr const char* kStateNames[FusionBusReplay::kStates] = {"idle", "command", "jsonStart", "capture", "skip", "respond", "transmit"};
+
+    using Clock = std::chrono::steady_clock;
+
+    // our replies come back through the half-duplex loopback, as on the line
+    void hearEcho(FusionBusSlave& slave)
+    {
+        NativeHal::serialTakeOutput(USART1);
+        HardwareSerial usart(USART1);
+        std::string echo;
+        while(usart.available())
+            echo.push_back((char)usart.read());
+        if(!echo.empty())
+            slave.replay((const uint8_t*)echo.data(), echo.size());
+    }
+
+    // 1 ms steps up to kSettleMs after the last byte, then straight to the target
+    void runUntil(FusionBusSlave& slave, unsigned long targetMs, unsigned long lastByteMs)
+    {
+        while(millis() < targetMs)
+        {
+            const unsigned long stepMs = millis() < lastByteMs + kSettleMs ? 1 : targetMs - millis();
+            NativeHal::advanceMicros(stepMs * 1000);
+            slave.replay(nullptr, 0);
+            hearEcho(slave);
+        }
+    }
+}
+
+FusionBusReplay::Report FusionBusReplay::run(const uint8_t* capture, size_t size, const Options& options)
+{
+    static_assert(kStates == static_cast<size_t>(FusionBusSlave::State::Transmit) + 1, "kStates covers FusionBusSlave::State");
+    NativeHal::reset();
+    Report report;
+    FusionBusSlave slave;
+    slave.begin(kBaud);
+    hearEcho(slave); // banner
+    slave.setBinaryMode(options.binary);
+    if(options.id)
+        slave.setAddressFilter([id = *options.id](uint32_t frameId) { return frameId == id; });
+    slave.onCommunicate([&](std::string_view json, FusionBusSlave::Response& response)
+    {
+        report.accepted++;
+        report.lastFrame.assign(json);
+        return options.reply and response.assign("{\"replay\":true}");
+    });
+
+    // record times count from 1 ms, millis() starts at 0 after the reset
+    BusCapture::Reader reader(capture, size);
+    BusCapture::Record record;
+    unsigned long firstMs = 0;
+    unsigned long lastByteMs = 0;
+    double totalNs = 0;
+    std::vector<double> nsPerByte;
+    while(reader.next(record))
+    {
+        if(report.records == 0)
+            firstMs = record.atMs;
+        runUntil(slave, 1 + record.atMs - firstMs, lastByteMs);
+        const auto start = Clock::now();
+        slave.replay(record.bytes, record.size);
+        const double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        hearEcho(slave);
+        totalNs += ns;
+        nsPerByte.push_back(ns / record.size);
+        report.bytes += record.size;
+        report.records++;
+        report.spanMs = record.atMs - firstMs;
+        lastByteMs = millis();
+    }
+    runUntil(slave, lastByteMs + kSettleMs, lastByteMs); // a frame cut off at the end times out too
+
+    report.torn = !reader.done();
+    report.foreign = slave.foreignFrames();
+    report.oversized = slave.oversizedFrames();
+    report.corrupt = slave.corruptFrames();
+    for(size_t state = 0; state < kStates; state++)
+    {
+        report.timeouts[state] = slave.timeoutHits(static_cast<FusionBusSlave::State>(state));
+        report.timeoutTotal += report.timeouts[state];
+    }
+    report.nsPerByte = report.bytes ? totalNs / report.bytes : 0;
+    if(!nsPerByte.empty())
+    {
+        std::sort(nsPerByte.begin(), nsPerByte.end());
+        report.p99NsPerByte = nsPerByte[(size_t)(0.99 * (nsPerByte.size() - 1))];
+        report.maxNsPerByte = nsPerByte.back();
+    }
+    return report;
+}
+
+unsigned long FusionBusReplay::fuzz(Capture& capture, unsigned long startMs, size_t bytes, uint32_t seed)
+{
+    uint32_t random = seed ? seed : 1;
+    auto next = [&](uint32_t bound)
+    {
+        random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+        return random % bound;
+    };
+    static const std::string kTrigger = "FusionBusCommunicate";
+    double atUs = startMs * 1000.0;
+    size_t written = 0;
+    while(written < bytes)
+    {
+        std::string piece;
+        switch(next(10))
+        {
+            case 0: // whole frame, for the filtered id or another one
+                piece = kTrigger + " {\"id\":" + std::to_string(next(4)) + ",\"ventingPercent\":" + std::to_string(next(101)) + "}\n";
+                break;
+            case 1: // trigger cut short, the matcher restarts on the next one
+                piece = kTrigger.substr(0, 1 + next(kTrigger.size()));
+                break;
+            case 2: // near misses and repeats
+                piece = "FusionBuFusionBusPaiFusionBusCommunicat" + kTrigger + kTrigger + "Communicate";
+                break;
+            case 3: // deep nesting, closed or left for the jsonCompleteMs timeout
+            {
+                const size_t depth = 1 + next(200);
+                piece = kTrigger + std::string(depth, '{') + "\"id\":1" + std::string(next(2) ? depth : depth / 2, '}');
+                break;
+            }
+            case 4: // quotes and braces inside strings, the scanner must not count them
+                piece = kTrigger + "{\"note\":\"\\\"}{\\\\\\\"]\",\"id\":" + std::to_string(next(4)) + ",\"s\":\"}}}}\"}";
+                break;
+            case 5: // an id longer than any uint32
+                piece = kTrigger + "{\"id\":" + std::string(10 + next(30), '9') + "}";
+                break;
+            case 6: // more than the 1 KB capture buffer
+                piece = kTrigger + "{\"id\":1,\"pad\":\"" + std::string(1000 + next(200), 'x') + "\"}";
+                break;
+            case 7: // line noise
+                for(uint32_t i = 0, n = 1 + next(64); i < n; i++)
+                    piece.push_back((char)next(256));
+                break;
+            case 8: // binary-looking bytes, COBS delimiters
+                piece = std::string(1 + next(8), '\0') + "\x02\x01\x03" + std::string(1 + next(70), '\x05');
+                break;
+            default: // a pause long enough for the timeouts
+                atUs += (100 + next(300)) * 1000.0;
+                continue;
+        }
+        for(char c : piece) // at line rate
+        {
+            capture.record((uint8_t)c, (unsigned long)(atUs / 1000));
+            atUs += kByteUs;
+        }
+        written += piece.size();
+        atUs += next(3) * 1000.0;
+    }
+    return (unsigned long)(atUs / 1000) + 1;
+}
+
+void FusionBusReplay::record(Capture& capture, unsigned long atMs, const std::string& bytes)
+{
+    for(char c : bytes)
+        capture.record((uint8_t)c, atMs);
+}
+
+bool FusionBusReplay::loadHex(const char* path, std::vector<uint8_t>& capture)
+{
+    std::ifstream file(path);
+    if(!file)
+        return false;
+    capture.clear();
+    int high = -1;
+    for(char c; file.get(c);)
+    {
+        if(std::isspace((unsigned char)c))
+            continue;
+        const int value = c >= '0' and c <= '9' ? c - '0' : c >= 'a' and c <= 'f' ? c - 'a' + 10 : c >= 'A' and c <= 'F' ? c - 'A' + 10 : -1;
+        if(value < 0)
+            return false;
+        if(high < 0)
+            high = value;
+        else
+        {
+            capture.push_back((uint8_t)(high << 4 | value));
+            high = -1;
+        }
+    }
+    return high < 0;
+}
+
+std::string FusionBusReplay::Report::summary() const
+{
+    char line[160];
+    std::string out;
+    snprintf(line, sizeof(line), "%zu bytes in %zu records over %.1f s%s\n", bytes, records, spanMs / 1000.0, torn ? ", torn at the end" : "");
+    out += line;
+    snprintf(line, sizeof(line), "accepted %zu, foreign %zu, oversized %zu, corrupt binary %zu, timeouts %zu:", accepted, foreign, oversized, corrupt, timeoutTotal);
+    out += line;
+    for(size_t state = 0; state < kStates; state++)
+    {
+        snprintf(line, sizeof(line), " %s %zu", kStateNames[state], timeouts[state]);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "\nparser %.1f ns/byte (%.1f MB/s), per record p99 %.1f ns/byte, max %.1f ns/byte\n", nsPerByte,
+             nsPerByte > 0 ? 1e3 / nsPerByte : 0.0, p99NsPerByte, maxNsPerByte);
+    out += line;
+    return out;
+}
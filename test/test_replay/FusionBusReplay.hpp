@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include "BusCapture.hpp"
+
+// Host replay of FusionBus traffic captured with FUSIONBUS_CAPTURE (see src/BusCapture.hpp):
+// every record goes through FusionBusSlave::replay() at its own virtual millis(), and the
+// time between records runs in 1 ms steps, so the Timeouts fire as they did on the line.
+// The parser works with a counting callback instead of SystemFacade, the figures are its own.
+class FusionBusReplay
+{
+public:
+    using Capture = BusCapture::Recorder<1 << 20>; // host-side recorder, allocate it on the heap
+    static constexpr size_t kStates = 7; // FusionBusSlave::State
+
+    struct Options
+    {
+        std::optional<uint32_t> id; // address filter as on the device, nullopt accepts every frame
+        bool reply = true; // answer accepted frames, the parser sits out the turnaround like on the line
+        bool binary = false; // binary mode as negotiated on the device: every byte goes through both parsers
+    };
+    struct Report
+    {
+        size_t bytes = 0;
+        size_t records = 0;
+        unsigned long spanMs = 0; // first to last record
+        bool torn = false; // the capture ends inside a record
+        size_t accepted = 0; // Communicate frames handed to the callback
+        size_t foreign = 0; // skipped for another id
+        size_t oversized = 0;
+        size_t corrupt = 0; // binary frames
+        size_t timeouts[kStates] = {}; // partial frames given up, by state
+        size_t timeoutTotal = 0;
+        double nsPerByte = 0; // host time inside the parser
+        double p99NsPerByte = 0; // per record; the host scheduler shows up in the max
+        double maxNsPerByte = 0;
+        std::string lastFrame; // the last accepted frame
+        std::string summary() const;
+    };
+
+    static Report run(const uint8_t* capture, size_t size, const Options& options);
+    // Parser-hostile traffic from startMs on: trigger fragments, frames cut off by the
+    // timeouts, deep nesting, escaped quotes and braces in strings, long ids, oversized and
+    // foreign frames, noise. Returns the virtual time after the last byte.
+    static unsigned long fuzz(Capture& capture, unsigned long startMs, size_t bytes, uint32_t seed);
+    static void record(Capture& capture, unsigned long atMs, const std::string& bytes);
+    // hex text, the concatenated "hex" fields of the capture query; whitespace is skipped
+    static bool loadHex(const char* path, std::vector<uint8_t>& capture);
+};
@@ -0,0 +1,161 @@
+// Bus capture format and parser replay: run with `pio test -e native -f test_replay -v`
+// for the throughput figures. FUSIONBUS_CAPTURE=<file> replays a capture read off a device
+// (the concatenated "hex" fields of {"id":..,"capture":offset}), FUSIONBUS_REPLAY_ID sets
+// the address filter for it and FUSIONBUS_REPLAY_BINARY=1 replays it in binary mode.
+#include <unity.h>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include "FusionBusReplay.hpp"
+
+namespace
+{
+    using Capture = FusionBusReplay::Capture;
+
+    std::string frame(uint32_t id, const std::string& rest = "")
+    {
+        return "FusionBusCommunicate {\"id\":" + std::to_string(id) + rest + "}\n";
+    }
+
+    FusionBusReplay::Report replay(const Capture& capture, const FusionBusReplay::Options& options)
+    {
+        const FusionBusReplay::Report report = FusionBusReplay::run(capture.data(), capture.size(), options);
+        TEST_MESSAGE(report.summary().c_str());
+        return report;
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+// same-millisecond bytes share a record, long pauses and full records start new ones
+void capture_round_trip()
+{
+    auto capture = std::make_unique<Capture>();
+    FusionBusReplay::record(*capture, 5000, "ab");
+    FusionBusReplay::record(*capture, 5001, "c");
+    FusionBusReplay::record(*capture, 5001 + 200000, std::string(300, 'x'));
+
+    BusCapture::Reader reader(capture->data(), capture->size());
+    BusCapture::Record record;
+    TEST_ASSERT_TRUE(reader.next(record));
+    TEST_ASSERT_EQUAL_UINT32(0, record.atMs);
+    TEST_ASSERT_EQUAL_STRING_LEN("ab", record.bytes, 2);
+    TEST_ASSERT_EQUAL_size_t(2, record.size);
+    TEST_ASSERT_TRUE(reader.next(record));
+    TEST_ASSERT_EQUAL_UINT32(1, record.atMs);
+    TEST_ASSERT_EQUAL_size_t(1, record.size);
+    TEST_ASSERT_TRUE(reader.next(record));
+    TEST_ASSERT_EQUAL_UINT32(200001, record.atMs);
+    TEST_ASSERT_EQUAL_size_t(255, record.size);
+    TEST_ASSERT_TRUE(reader.next(record));
+    TEST_ASSERT_EQUAL_UINT32(200001, record.atMs);
+    TEST_ASSERT_EQUAL_size_t(45, record.size);
+    TEST_ASSERT_FALSE(reader.next(record));
+    TEST_ASSERT_TRUE(reader.done());
+    TEST_ASSERT_EQUAL_size_t(303 + 2 + 2 + 4 + 2, capture->size()); // delta and count per record
+}
+
+// a full recorder keeps the start and counts the rest, freeze() stops it until clear()
+void capture_full_and_frozen()
+{
+    BusCapture::Recorder<16> capture;
+    for(unsigned long ms = 0; ms < 10; ms++)
+        capture.record('a', ms * 2);
+    TEST_ASSERT_EQUAL_size_t(15, capture.size()); // 5 records of delta, count and byte
+    TEST_ASSERT_EQUAL_UINT32(5, capture.dropped());
+    BusCapture::Reader reader(capture.data(), capture.size());
+    BusCapture::Record record;
+    size_t records = 0;
+    while(reader.next(record))
+        records++;
+    TEST_ASSERT_EQUAL_size_t(5, records);
+    TEST_ASSERT_TRUE(reader.done()); // no record is cut off, a record that doesn't fit is dropped whole
+
+    capture.clear();
+    capture.record('a', 0);
+    capture.freeze();
+    capture.record('b', 0);
+    TEST_ASSERT_EQUAL_size_t(3, capture.size());
+    capture.clear();
+    capture.record('c', 7);
+    TEST_ASSERT_EQUAL_size_t(3, capture.size());
+}
+
+// every way a frame can end is counted where it belongs
+void replay_accounts_frames()
+{
+    auto capture = std::make_unique<Capture>();
+    FusionBusReplay::record(*capture, 0, frame(7, ",\"ventingPercent\":40"));
+    FusionBusReplay::record(*capture, 100, frame(8, ",\"ventingPercent\":40")); // foreign
+    FusionBusReplay::record(*capture, 200, "FusionBusCommunicate {\"id\":7,\"ventin"); // cut off
+    FusionBusReplay::record(*capture, 700, frame(7, ",\"pad\":\"" + std::string(1100, 'x') + "\"")); // oversized
+    FusionBusReplay::record(*capture, 900, "FusionBusCommunicate"); // no JSON follows
+    FusionBusReplay::record(*capture, 1300, frame(7, ",\"ventingPercent\":60"));
+    FusionBusReplay::record(*capture, 1305, frame(7)); // inside the turnaround guard, unheard
+
+    FusionBusReplay::Options options;
+    options.id = 7;
+    const FusionBusReplay::Report report = replay(*capture, options);
+    TEST_ASSERT_EQUAL_size_t(2, report.accepted);
+    TEST_ASSERT_EQUAL_STRING("{\"id\":7,\"ventingPercent\":60}", report.lastFrame.c_str());
+    TEST_ASSERT_EQUAL_size_t(1, report.foreign);
+    TEST_ASSERT_EQUAL_size_t(1, report.oversized);
+    TEST_ASSERT_EQUAL_size_t(1, report.timeouts[3]); // CaptureJson
+    TEST_ASSERT_EQUAL_size_t(1, report.timeouts[2]); // WaitJsonStart
+    TEST_ASSERT_EQUAL_size_t(2, report.timeoutTotal);
+    TEST_ASSERT_FALSE(report.torn);
+}
+
+// field capture from FUSIONBUS_CAPTURE, skipped without one
+void replay_capture_file()
+{
+    const char* path = std::getenv("FUSIONBUS_CAPTURE");
+    if(!path)
+        TEST_IGNORE_MESSAGE("set FUSIONBUS_CAPTURE to a hex capture file");
+    std::vector<uint8_t> capture;
+    TEST_ASSERT_TRUE_MESSAGE(FusionBusReplay::loadHex(path, capture), "not a hex capture");
+    FusionBusReplay::Options options;
+    if(const char* id = std::getenv("FUSIONBUS_REPLAY_ID"))
+        options.id = (uint32_t)std::strtoul(id, nullptr, 10);
+    if(const char* binary = std::getenv("FUSIONBUS_REPLAY_BINARY"))
+        options.binary = std::strcmp(binary, "1") == 0;
+    const FusionBusReplay::Report report = FusionBusReplay::run(capture.data(), capture.size(), options);
+    TEST_MESSAGE(report.summary().c_str());
+    TEST_ASSERT_GREATER_THAN(0, report.records);
+}
+
+// parser-hostile traffic reports the per-byte cost, in text and in binary mode, where every
+// byte also goes through the binary parser; whatever it left behind, after a quiet second the
+// parser takes the next frame as if nothing happened
+void fuzz_parser()
+{
+    auto capture = std::make_unique<Capture>();
+    const unsigned long endMs = FusionBusReplay::fuzz(*capture, 0, 200000, 1);
+    FusionBusReplay::record(*capture, endMs + 1000, frame(1, ",\"ventingPercent\":77"));
+
+    for(bool binary : {false, true})
+    {
+        FusionBusReplay::Options options;
+        options.id = 1;
+        options.binary = binary;
+        const FusionBusReplay::Report report = replay(*capture, options);
+        TEST_ASSERT_EQUAL_STRING("{\"id\":1,\"ventingPercent\":77}", report.lastFrame.c_str());
+        TEST_ASSERT_GREATER_THAN(0, report.foreign);
+        TEST_ASSERT_GREATER_THAN(0, report.oversized);
+        TEST_ASSERT_GREATER_THAN(0, report.timeoutTotal);
+        TEST_ASSERT_EQUAL(binary, report.corrupt > 0);
+        TEST_ASSERT_FALSE(report.torn);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(capture_round_trip);
+    RUN_TEST(capture_full_and_frozen);
+    RUN_TEST(replay_accounts_frames);
+    RUN_TEST(replay_capture_file);
+    RUN_TEST(fuzz_parser);
+    return UNITY_END();
+}